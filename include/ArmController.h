@@ -4,7 +4,14 @@
 #include <sstream>
 #include <fstream>
 #include <vector>
+#include <deque>
 #include <ctime>
+#include <cstdlib>
+#include <random>
+#include <atomic>
+#include <algorithm>
+
+#include <boost/thread.hpp>
 
 #include <tf2_geometry_msgs/tf2_geometry_msgs.h>
 #include <tf2/utils.h>
@@ -15,8 +22,14 @@
 #include <moveit/move_group_interface/move_group_interface.h>
 #include <moveit/planning_scene/planning_scene.h>
 #include <moveit/planning_scene_monitor/planning_scene_monitor.h>
+#include <moveit/planning_pipeline/planning_pipeline.h>
+#include <moveit/robot_model_loader/robot_model_loader.h>
+#include <moveit/collision_detection_fcl/collision_detector_allocator_fcl.h>
+#include <moveit/collision_detection_bullet/collision_detector_allocator_bullet.h>
 #include <moveit/robot_state/conversions.h>
 #include <moveit/kinematic_constraints/utils.h>
+#include <moveit/robot_trajectory/robot_trajectory.h>
+#include <moveit/trajectory_processing/iterative_time_parameterization.h>
 #include <actionlib/client/simple_action_client.h>
 
 #include "control_msgs/GripperCommandAction.h"
@@ -27,6 +40,9 @@
 #include "std_msgs/String.h"
 #include "std_msgs/Float32.h"
 
+#include "SceneMirror.h"
+#include "ObjectDatabase.h"
+
 class ArmController {
 public:
   enum PlanLibrary {
@@ -83,17 +99,70 @@ public:
   std::vector<double> clearanceData(moveit_msgs::RobotTrajectory traj);
 
     ArmController(ros::NodeHandle& nh, bool rep = false);
+  ~ArmController();
   void setHumanChecks(bool on) { checkPlans = on; }
   void setLibrary(std::string l);
   void setLibrary(PlanLibrary l);
   void setPlanner(std::string p);
   void setPlanner(PlanAlgorithm p);
     void setPlanningTime(double t);
+  void setAdaptiveSpeed(bool on);
+  void setSpeedCurve(std::vector<double> clearances,
+                     std::vector<double> scales);
+  void setWaypointTolerance(double t) { waypointTolerance = t; }
+  void setRegionSampling(int samples, int topK);
+  void setDirectPaths(bool on) { directPaths = on; }
+  void setSceneJitterThresholds(double trans, double rot);
+  // Lets local scene objects share the database's prebuilt shapes
+  // Called again after a reload; objects already in the scenes keep the
+  // shapes they were added with
+  void setObjectDatabase(std::shared_ptr<ObjectDatabase> db,
+                         std::shared_ptr<ObjectDatabase> unpadded = std::shared_ptr<ObjectDatabase>())
+  {
+    boost::lock_guard<boost::mutex> guard(sceneMutex);
+    objData = db;
+    unpaddedData = unpadded;
+  }
+  // Plans against the padded and unpadded worlds at once, preferring a
+  // padded plan that arrives within grace (s) of an unpadded one
+  void setDualPlanning(bool on, double grace, double minClearance);
+  bool loadAllowedCollisions(std::string fileName);
+  // Says whether a world object has stopped moving. Once set, the arm
+  // waits up to timeout (s) for the objects it handles to settle instead
+  // of sleeping a fixed time.
+  typedef boost::function<bool(const std::string&)> SettleCheck;
+  void setSettleCheck(SettleCheck check, double timeout)
+  {
+    settleCheck = check;
+    settleTimeout = timeout;
+  }
+  // Collision detector for local checks, "fcl" or "bullet"
+  bool setCollisionBackend(std::string name);
+  // Also takes the detectors' own names, "FCL" and "Bullet"
+  static collision_detection::CollisionDetectorAllocatorPtr collisionAllocator(std::string name)
+  {
+    if (name == "fcl" || name == "FCL") return collision_detection::CollisionDetectorAllocatorFCL::create();
+    if (name == "bullet" || name == "Bullet") return collision_detection::CollisionDetectorAllocatorBullet::create();
+    return collision_detection::CollisionDetectorAllocatorPtr();
+  }
 
   std::string armPlanningFrame();
-  std::string getHeld() { return grabbedObject.id; }
+  std::string getHeld();
+  // When the joint states behind the current robot state were measured
+  ros::Time currentStateStamp();
+  moveit_msgs::RobotTrajectory getCurrentTrajectory() { return currentPlan.trajectory_; }
 
-  void updateCollisionScene(std::vector<moveit_msgs::CollisionObject> cos);
+  // worldVersion is the WorldSnapshot the objects came from. False if
+  // the update failed or was turned away by a pin to another version.
+  bool updateCollisionScene(std::vector<moveit_msgs::CollisionObject> cos,
+                            unsigned long worldVersion = 0);
+  bool updateUnpaddedScene(std::vector<moveit_msgs::CollisionObject> cos,
+                           unsigned long worldVersion = 0);
+  // While pinned only updates from worldVersion are applied, so a command
+  // plans, checks clearance and logs against the one snapshot
+  void pinScene(unsigned long worldVersion);
+  void unpinScene();
+  bool scenePinned();
   void attachToGripper(std::string objName);
   void detachHeldObject();
 
@@ -102,11 +171,12 @@ public:
   void setGripperClosed(bool isClosed);
 
   bool pickUp(tf2::Transform objXform,
-              std::vector<GraspPair> graspList,
+              const std::vector<GraspPair>& graspList,
               std::string objName);
   bool putDownHeldObj(std::vector<tf2::Transform> targets);
   bool pointTo(tf2::Transform objXform,
-               float objHeight);
+               float objHeight,
+               std::string objName = "");
   bool planToTargetList(std::vector<tf2::Transform> targets, int numTrials);
   bool planToRegionAsList(float xD, float yD, float zD, geometry_msgs::Pose p, int numTrials);
     bool checkReachable(tf2::Transform eeXform);
@@ -114,23 +184,72 @@ public:
   bool homeArm();
 
     void writeQuery(tf2::Transform t,
-                    moveit::planning_interface::MoveGroupInterface::Plan p);
+                    moveit::planning_interface::MoveGroupInterface::Plan p,
+                    std::string alg = "");
 private:
   void setGripperTo(float m);
+  void waitForSettled(const std::string& name, double fallback);
   bool planToXformInner(tf2::Transform t);
   bool planToXform(tf2::Transform t, int n);
+  bool planDirectToXform(tf2::Transform t, geometry_msgs::Pose target);
+  bool planDual(tf2::Transform t,
+                moveit::planning_interface::MoveGroupInterface::Plan& mp,
+                std::string& alg);
+  bool planDirectPath(robot_state::RobotState& start,
+                      robot_state::RobotState& goal,
+                      bool matchJoints);
   bool planToRegion(float xD, float yD, float zD, geometry_msgs::Pose p);
+  moveit_msgs::GetMotionPlan::Request basePlanRequest();
+  bool ikStateValid(const planning_scene::PlanningScene* ps,
+                    robot_state::RobotState* rs,
+                    const robot_state::JointModelGroup* jmg,
+                    const double* jointVals);
+  bool stateClear(const planning_scene::PlanningScene* ps,
+                  robot_state::RobotState& rs);
+  void solveIKParallel(std::vector<geometry_msgs::Pose>& poses,
+                       robot_state::RobotState& start,
+                       std::vector<robot_state::RobotState>& solutions,
+                       std::vector<int>& found);
+  // Plans to the goals PLAN_WORKERS at a time, returns index of the plan
+  // used or -1
+  int planToJointGoals(std::vector<robot_state::RobotState>& goals,
+                       bool inOrder,
+                       moveit_msgs::MotionPlanResponse& result);
   double planStraightLineMotion(tf2::Transform target);
+  std::vector<double> waypointClearances(moveit_msgs::RobotTrajectory& traj);
+  std::vector<double> waypointClearances(const planning_scene::PlanningScene* scene,
+                                         const collision_detection::AllowedCollisionMatrix& acm,
+                                         robot_state::RobotState rs,
+                                         moveit_msgs::RobotTrajectory& traj);
+  double speedForClearance(double clearance);
+  void retimeForClearance(moveit_msgs::RobotTrajectory& traj);
+  void reduceWaypoints(moveit_msgs::RobotTrajectory& traj);
+  void finishTrajectory(moveit_msgs::RobotTrajectory& traj);
   bool executeCurrentPlan();
   void writeHomeQuery(moveit::planning_interface::MoveGroupInterface::Plan p);
   void writeTrajectoryInfo(std::ofstream& ofs, moveit_msgs::RobotTrajectory& traj,
                            moveit_msgs::RobotState& ss);
   bool safetyCheck();
   void publishCurrentGoal(const ros::TimerEvent& e);
+  void sceneMonitorUpdated(planning_scene_monitor::PlanningSceneMonitor::SceneUpdateType type);
+  unsigned long tagSceneDiff(moveit_msgs::PlanningScene& diff);
+  void sceneDiffApplied(unsigned long diff);
+  bool waitForSceneMonitor(double timeout = 1.0);
+  robot_state::RobotState monitoredState();
+  unsigned long loggedSceneVersion();
+  void updateDistanceScenes();
+  void applyToLocalWorld(planning_scene::PlanningScenePtr scene,
+                         ObjectDatabase* db,
+                         const std::vector<moveit_msgs::CollisionObject>& ops);
+  std::vector<shapes::ShapeConstPtr> localShapesFor(const moveit_msgs::CollisionObject& co,
+                                                    ObjectDatabase* db);
   void setCurrentGoalTo(tf2::Transform t);
 
   std::string logFileName;
     rosbag::Bag bagFile;
+  // rosbag::Bag is not thread-safe, and scenes are logged from the sync
+  // thread while commands log queries
+  boost::mutex bagMutex;
     bool isReplay;
 
   moveit::planning_interface::MoveGroupInterface::Plan currentPlan;
@@ -145,6 +264,21 @@ private:
   PlanAlgorithm plannerName;
     double planningTime;
 
+  double velocityScaling;
+  // Speed scale as a piecewise linear function of clearance
+  bool adaptiveSpeed;
+  std::vector<double> curveClearances;
+  std::vector<double> curveScales;
+  // Max end effector deviation (m) allowed when dropping waypoints, 0 = off
+  double waypointTolerance;
+  // Goal poses sampled per region query and how many are planned to
+  int regionSamples;
+  int regionTopK;
+  // Try collision-free straight lines before calling the planner
+  bool directPaths;
+  int directQueries;
+  int directHits;
+
   geometry_msgs::PoseStamped currentGoal;
   ros::Publisher goalPublisher;
   ros::Timer pubTimer;
@@ -152,6 +286,57 @@ private:
   moveit::planning_interface::MoveGroupInterface group;
   ros::ServiceClient psDiffClient;
   ros::ServiceClient getPSClient;
+  SceneMirror sceneMirror;
+  // World version of the last scene update sent
+  unsigned long sceneVersion;
+  // 0 when not pinned
+  unsigned long pinnedVersion;
+  // Guards sceneMirror and grabbedObject against the scene sync thread
+  boost::mutex sceneMutex;
   planning_scene_monitor::PlanningSceneMonitorPtr psm;
+  // World objects for in-process checks, kept in step with the mirror so
+  // their shapes are built once; robot state still comes from psm
+  std::shared_ptr<ObjectDatabase> objData;
+  planning_scene::PlanningScenePtr localScene;
+  // Separate copies of the robot model for solveIKParallel's workers, as
+  // each owns its group's kinematics solver
+  std::vector<robot_model::RobotModelPtr> ikModels;
+  // Allows ground contact, plus link pairs that never or always collide
+  collision_detection::AllowedCollisionMatrix localACM;
+  boost::shared_mutex localMutex;
+
+  // Dual planning: the unpadded world, kept like the padded one, and an
+  // in-process planner for each
+  bool dualPlanning;
+  double dualGrace;
+  double dualMinClearance;
+  std::shared_ptr<ObjectDatabase> unpaddedData;
+  SceneMirror unpaddedMirror;
+  planning_scene::PlanningScenePtr unpaddedScene;
+  planning_pipeline::PlanningPipelinePtr paddedPipeline;
+  planning_pipeline::PlanningPipelinePtr unpaddedPipeline;
+  // FCL scenes sharing the worlds above, only when their detector can't
+  // measure distance; null otherwise
+  planning_scene::PlanningScenePtr distanceScene;
+  planning_scene::PlanningScenePtr unpaddedDistanceScene;
+  // Sequence numbers of the scene diffs we sent, the last one move_group
+  // accepted, and the last one psm has seen
+  boost::mutex monitorMutex;
+  boost::condition_variable monitorCond;
+  unsigned long diffsTagged;
+  unsigned long diffApplied;
+  unsigned long diffMonitored;
   ros::ServiceClient planRequestClient;
+  // planToJointGoals requests, served by a few long-lived threads that
+  // share planRequestClient
+  static const int PLAN_WORKERS = 3;
+  struct PlanBatch;
+  void planWorkerLoop();
+  boost::mutex planQueueMutex;
+  boost::condition_variable planQueueCond;
+  std::deque<std::pair<std::shared_ptr<PlanBatch>, int> > planQueue;
+  bool stopPlanWorkers;
+  boost::thread_group planWorkers;
+  SettleCheck settleCheck;
+  double settleTimeout;
 };
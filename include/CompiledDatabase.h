@@ -0,0 +1,111 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstdint>
+
+#include <tf2/utils.h>
+#include <shape_msgs/SolidPrimitive.h>
+
+// Binary form of an object_info.json file, written by objectdbcompiler.
+// Every record is fixed size with transforms already as quaternions and
+// the bounding radii already computed, so loading is a memory map and a
+// walk over the records with no parsing.
+//
+// Layout: Header, ObjectRecords, ShapeRecords, GraspRecords, then the
+// names. The checksum covers everything after the header.
+class CompiledDatabase {
+public:
+  static const uint32_t MAGIC = 0x42444f52; // "RODB"
+  static const uint32_t FORMAT_VERSION = 2;
+  static const uint32_t NO_GRASPS = 0xffffffff;
+
+  struct Header {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t checksum;
+    // The json it was compiled from, to tell when it is stale
+    uint64_t sourceSize;
+    int64_t sourceMtime;
+    uint32_t numObjects;
+    uint32_t numShapes;
+    uint32_t numGrasps;
+    uint32_t nameBytes;
+  };
+
+  struct ObjectRecord {
+    uint32_t nameOffset;
+    uint32_t nameLength;
+    uint32_t firstShape;
+    uint32_t numShapes;
+    uint32_t firstGrasp;
+    // NO_GRASPS for collision-only entries
+    uint32_t numGrasps;
+    float footprintRadius;
+    float boundingRadius;
+  };
+
+  // Transforms are x y z qx qy qz qw
+  struct ShapeRecord {
+    uint32_t type;
+    uint32_t numDimensions;
+    double dimensions[3];
+    double xform[7];
+  };
+
+  struct GraspRecord {
+    double first[7];
+    double second[7];
+  };
+
+  // One database entry to write
+  struct Entry {
+    std::string name;
+    std::vector<std::pair<tf2::Transform, shape_msgs::SolidPrimitive> > shapes;
+    bool hasGrasps;
+    std::vector<std::pair<tf2::Transform, tf2::Transform> > grasps;
+    float footprintRadius;
+    float boundingRadius;
+  };
+
+  CompiledDatabase() : data(NULL), size(0) {}
+  ~CompiledDatabase() { close(); }
+
+  // Maps file and checks it is complete, current for source, and intact,
+  // and that every record's name, shapes and grasps lie inside the file
+  bool open(const std::string& file, const std::string& source);
+  void close();
+
+  static bool write(const std::string& file, const std::string& source,
+                    const std::vector<Entry>& entries);
+
+  int numObjects() const { return header()->numObjects; }
+  const ObjectRecord& object(int i) const { return objects()[i]; }
+  std::string name(const ObjectRecord& o) const {
+    return std::string(names() + o.nameOffset, o.nameLength);
+  }
+  const ShapeRecord& shape(int i) const { return shapes()[i]; }
+  const GraspRecord& grasp(int i) const { return grasps()[i]; }
+
+  static tf2::Transform toXform(const double* d);
+  static void fromXform(const tf2::Transform& xf, double* d);
+
+private:
+  static bool sourceStamp(const std::string& source, uint64_t& size, int64_t& mtime);
+  static uint64_t checksum(const char* bytes, std::size_t length);
+  static std::size_t payloadSize(const Header& h);
+  bool recordsInBounds() const;
+
+  const Header* header() const { return (const Header*)data; }
+  const ObjectRecord* objects() const { return (const ObjectRecord*)(data + sizeof(Header)); }
+  const ShapeRecord* shapes() const {
+    return (const ShapeRecord*)(objects() + header()->numObjects);
+  }
+  const GraspRecord* grasps() const {
+    return (const GraspRecord*)(shapes() + header()->numShapes);
+  }
+  const char* names() const { return (const char*)(grasps() + header()->numGrasps); }
+
+  const char* data;
+  std::size_t size;
+};
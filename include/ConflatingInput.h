@@ -0,0 +1,61 @@
+#pragma once
+
+#include <ros/time.h>
+#include <boost/thread.hpp>
+
+// Holds only the newest message of a topic until a worker takes it, so a
+// slow consumer skips stale messages instead of working through a queue.
+// The subscriber callback only swaps a pointer.
+template <class M>
+class ConflatingInput {
+public:
+  typedef typename M::ConstPtr MsgPtr;
+
+  struct Counts {
+    unsigned long received;
+    // Replaced by a newer message before anyone took them
+    unsigned long conflated;
+    unsigned long processed;
+  };
+
+  ConflatingInput() {
+    counts.received = 0;
+    counts.conflated = 0;
+    counts.processed = 0;
+  }
+
+  void put(const MsgPtr& msg) {
+    boost::lock_guard<boost::mutex> guard(inputMutex);
+    if (pending) counts.conflated++;
+    pending = msg;
+    pendingStamp = ros::Time::now();
+    counts.received++;
+    inputCond.notify_one();
+  }
+
+  // The newest message, waiting up to timeout seconds for one; NULL if
+  // nothing arrived. received is when put() got it.
+  MsgPtr take(double timeout, ros::Time* received = NULL) {
+    boost::unique_lock<boost::mutex> lock(inputMutex);
+    if (!pending) {
+      inputCond.timed_wait(lock, boost::posix_time::microseconds((long)(timeout*1e6)));
+    }
+    MsgPtr msg = pending;
+    if (received) *received = pendingStamp;
+    pending.reset();
+    if (msg) counts.processed++;
+    return msg;
+  }
+
+  Counts getCounts() {
+    boost::lock_guard<boost::mutex> guard(inputMutex);
+    return counts;
+  }
+
+private:
+  MsgPtr pending;
+  ros::Time pendingStamp;
+  Counts counts;
+  boost::mutex inputMutex;
+  boost::condition_variable inputCond;
+};
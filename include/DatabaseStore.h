@@ -0,0 +1,51 @@
+#pragma once
+
+#include <string>
+#include <memory>
+
+#include <boost/thread.hpp>
+#include <boost/function.hpp>
+#include <boost/atomic.hpp>
+
+#include "ObjectDatabase.h"
+
+// Owns the current ObjectDatabase and replaces it without stopping anyone:
+// a reload builds a whole new database on its own thread and swaps it in
+// atomically. Readers take get() once per command and keep that version
+// until they let go of it, so they never see a half loaded database.
+class DatabaseStore {
+public:
+  typedef std::shared_ptr<ObjectDatabase> Ptr;
+
+  DatabaseStore(std::string file, std::string compiled = "");
+  ~DatabaseStore();
+
+  Ptr get() { return std::atomic_load(&current); }
+
+  // Returns at once; false, doing nothing, if a reload is already running
+  bool reloadAsync();
+  // Also reload whenever the json or compiled file changes, checking
+  // every period seconds
+  void watch(double period);
+  // Called on the reload thread after each swap; a reload that fails
+  // keeps the old database and does not swap
+  void setOnSwap(boost::function<void(Ptr)> cb) { onSwap = cb; }
+
+private:
+  void reloadLoop();
+  void watchLoop(double period);
+  // mtimes of both files, to notice edits
+  std::pair<long, long> fileStamps();
+
+  std::string fileName;
+  std::string compiledName;
+  // Only read and written with std::atomic_load/store
+  Ptr current;
+  // Counts loads, for the logs
+  boost::atomic<unsigned long> loads;
+  boost::atomic<bool> reloading;
+  boost::function<void(Ptr)> onSwap;
+
+  boost::thread reloadThread;
+  boost::thread watchThread;
+};
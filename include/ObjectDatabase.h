@@ -2,37 +2,112 @@
 
 #include <string>
 #include <map>
+#include <memory>
+#include <unordered_map>
+#include <boost/thread.hpp>
 #include <fstream>
 #include <ros/ros.h>
 #include <tf2_geometry_msgs/tf2_geometry_msgs.h>
 #include <tf2/utils.h>
 #include <shape_msgs/SolidPrimitive.h>
-#include "rapidjson/document.h"
+#include <geometric_shapes/shapes.h>
+#include <geometric_shapes/shape_operations.h>
+
+#include "SubstringIndex.h"
 
 typedef std::pair<tf2::Transform, tf2::Transform> GraspPair;
 typedef std::pair<tf2::Transform, shape_msgs::SolidPrimitive> SubShape;
 
+// Collision geometry built once per database entry, one shape per SubShape
+struct CollisionGeometry {
+  std::vector<shapes::ShapeConstPtr> shapes;
+  float footprintRadius;
+  float boundingRadius;
+};
+
+// Everything known about one database object. Entries are built once at
+// load and never modified, so they are handed out by reference.
+struct DatabaseEntry {
+  std::string name;
+  std::vector<SubShape> shapes;
+  CollisionGeometry geometry;
+  bool hasGrasps;
+  std::vector<GraspPair> grasps;
+};
+typedef std::shared_ptr<const DatabaseEntry> DatabaseEntryPtr;
+
+// What a scene object name resolves to in the database
+struct Resolution {
+  // "" when nothing matches
+  std::string dbName;
+  bool hasGrasps;
+  bool hasModel;
+  // NULL when nothing matches
+  const DatabaseEntry* entry;
+};
+
 class ObjectDatabase {
 public:
-  ObjectDatabase() {
+  // compiled is the binary made from file by objectdbcompiler; it is
+  // used instead of file when it is current
+  ObjectDatabase(std::string file, std::string compiled = "") : fileName(file),
+                                                                compiledName(compiled),
+                                                                numWithGrasps(0),
+                                                                loaded(false) {
     init();
   }
 
-  void reload();
+  // False if the files could not be read or the json had errors; a
+  // failed load may still hold the objects read before the error
+  bool ok() const { return loaded; }
+
+  // Writes the binary form of what was loaded
+  bool compile(std::string outFile);
+
+  // Cached, since scene names do not change. The reference is good for
+  // as long as this database is; DatabaseStore replaces the whole
+  // database on reload.
+  const Resolution& resolve(const std::string& objectID);
 
   bool isInDatabase(std::string objectID);
   bool dbHasGrasps(std::string objectID);
   bool dbHasModel(std::string objectID);
   std::string findDatabaseName(std::string objectID);
 
-  std::vector<SubShape> getCollisionModel(std::string dbName);
-  int getNumGrasps(std::string dbName);
-  std::vector<GraspPair> getAllGrasps(std::string dbName);
-  GraspPair getGraspAtIndex(std::string dbName, int index);
+  // NULL if there is no such entry. Holding on to the entry keeps it
+  // alive even if the database is reloaded.
+  DatabaseEntryPtr getEntry(const std::string& dbName) const;
+
+  // Views into the entry, empty if there is none; they are good for as
+  // long as this database is
+  const std::vector<SubShape>& getCollisionModel(const std::string& dbName) const;
+  int getNumGrasps(const std::string& dbName) const;
+  const std::vector<GraspPair>& getAllGrasps(const std::string& dbName) const;
+  // NULL if the entry or the index does not exist
+  const GraspPair* getGraspAtIndex(const std::string& dbName, int index) const;
+  float getFootprintRadius(const std::string& dbName) const;
+  float getBoundingRadius(const std::string& dbName) const;
+  // Shared with every scene the object is added to, so never modify them
+  const std::vector<shapes::ShapeConstPtr>& getCollisionShapes(const std::string& dbName) const;
+
+  // Fills in e.geometry from e.shapes
+  static void buildGeometry(DatabaseEntry& e);
 
 private:
   void init();
+  bool loadJson();
+  bool loadCompiled();
+  void addEntry(DatabaseEntryPtr e);
+
+  std::string fileName;
+  std::string compiledName;
+
+  std::map<std::string, DatabaseEntryPtr> entries;
+  int numWithGrasps;
+  bool loaded;
+  SubstringIndex graspIndex;
+  SubstringIndex modelIndex;
 
-  std::map<std::string, std::vector<SubShape> > collisionModels;
-  std::map<std::string, std::vector<GraspPair> > grasps;
+  std::unordered_map<std::string, Resolution> resolved;
+  boost::mutex resolveMutex;
 };
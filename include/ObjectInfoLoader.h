@@ -0,0 +1,78 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <boost/thread.hpp>
+
+#include "ObjectDatabase.h"
+
+// Reads object_info.json without building a document: a SAX parse over
+// the file buffer in place hands finished object records off in chunks,
+// and worker threads turn them into database entries while the parse goes
+// on. Problems are reported per object, in file order.
+class ObjectInfoLoader {
+public:
+  // threads 0 uses one per core, 1 converts on the calling thread
+  ObjectInfoLoader(int threads = 0, int chunk = 64);
+
+  // Entries come back in file order. Objects that cannot be used are
+  // reported and left out; after a parse error the objects read before
+  // it are still returned.
+  bool load(const std::string& fileName, std::vector<DatabaseEntryPtr>& entries);
+
+  int numObjects() const { return objectsRead; }
+  int numProblems() const { return problemsFound; }
+
+private:
+  // Strings point into the file buffer, which the parse leaves in place
+  struct RawShape {
+    const char* type;
+    std::vector<double> dimensions;
+    bool hasTransform;
+    bool hasTranslation;
+    bool hasRotation;
+    std::vector<double> translation;
+    std::vector<double> rotation;
+  };
+
+  struct RawGrasp {
+    std::vector<double> first;
+    std::vector<double> second;
+  };
+
+  struct Record {
+    int index;
+    std::size_t offset;
+    const char* name;
+    bool isObject;
+    bool hasShapes;
+    std::vector<RawShape> shapes;
+    bool hasGrasps;
+    std::vector<RawGrasp> grasps;
+
+    // Filled in by convert
+    DatabaseEntryPtr entry;
+    std::vector<std::string> problems;
+  };
+
+  typedef std::vector<Record> Chunk;
+
+  class Handler;
+
+  // Called by the parse each time chunkSize records are finished
+  void submit(std::shared_ptr<Chunk> c);
+  void workerLoop();
+  static void convert(Record& r);
+
+  int numThreads;
+  int chunkSize;
+  int objectsRead;
+  int problemsFound;
+
+  std::vector<std::shared_ptr<Chunk> > chunks;
+  int nextChunk;
+  bool parsing;
+  boost::mutex chunkMutex;
+  boost::condition_variable chunkReady;
+};
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <unordered_map>
+
+#include <ros/ros.h>
+#include <tf2/utils.h>
+#include <boost/thread.hpp>
+
+#include "WorldSnapshot.h"
+
+// The last few seconds of every object's pose, in a fixed-size ring per
+// object that is allocated when the object is first seen and freed once
+// it is gone from the world. Queries do not allocate, and interpolate
+// between the recorded samples.
+//
+// Each ring has its own lock, so a query only waits while that one
+// object is written. The name index is only locked exclusively when
+// objects come or go.
+class PoseHistory {
+public:
+  PoseHistory(int samplesPerObject = 200) : capacity(samplesPerObject), records(0) {}
+
+  // Adds every object in snap as seen at stamp and forgets objects snap
+  // no longer has. Stamps must not go back; one thread records.
+  void record(const WorldSnapshot& snap, ros::Time stamp);
+
+  // Pose in the world frame at time t, interpolating between samples.
+  // False if the object is unknown or t is outside what is kept.
+  bool getXformAt(const std::string& name, ros::Time t, tf2::Transform& xf);
+  // True if over the window up to now the object never moved more than
+  // trans (m) or rot (rad) from where it is now. Needs samples covering
+  // the whole window.
+  bool isStationary(const std::string& name, ros::Time now, ros::Duration window,
+                    double trans, double rot);
+
+private:
+  struct Track {
+    boost::mutex mutex;
+    std::vector<ros::Time> stamps;
+    std::vector<tf2::Vector3> positions;
+    std::vector<tf2::Quaternion> rotations;
+    // Slot the next sample goes in, and how many are kept
+    int head;
+    int count;
+    // The record call that last saw the object
+    unsigned long seen;
+  };
+  typedef std::unordered_map<std::string, std::shared_ptr<Track> > TrackMap;
+
+  void add(Track& tr, ros::Time stamp, const tf2::Vector3& p, const tf2::Quaternion& q);
+
+  // Slot of the ith oldest sample
+  int slot(const Track& tr, int i) const {
+    return (tr.head - tr.count + i + capacity) % capacity;
+  }
+
+  int capacity;
+  unsigned long records;
+  TrackMap tracks;
+  boost::shared_mutex indexMutex;
+};
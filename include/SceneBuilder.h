@@ -0,0 +1,64 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+#include <ros/ros.h>
+#include <tf2_geometry_msgs/tf2_geometry_msgs.h>
+#include <tf2/utils.h>
+
+#include "moveit_msgs/CollisionObject.h"
+
+#include "ObjectDatabase.h"
+#include "WorldSnapshot.h"
+#include "SpatialGrid.h"
+
+// Turns a world snapshot into collision objects for the planning scene,
+// keeping the database objects inside the arm's workspace and, when there
+// is one, the task region. Not thread-safe; MotionServer builds under
+// pushMutex.
+class SceneBuilder {
+public:
+  SceneBuilder() : workspaceCenter(0.15, 0.0, 0.9),
+                   workspaceRadius(1.4),
+                   lastCulled(-1),
+                   buildStamp(0) {}
+
+  void setWorkspace(tf2::Vector3 center, double radius);
+
+  std::vector<moveit_msgs::CollisionObject> build(const WorldSnapshot& world,
+                                                  ObjectDatabase& db,
+                                                  bool useRegion,
+                                                  tf2::Vector3 lo,
+                                                  tf2::Vector3 hi);
+  // One world object with the shapes from db
+  moveit_msgs::CollisionObject databaseObject(const WorldSnapshot& world,
+                                              std::string id,
+                                              ObjectDatabase& db);
+
+private:
+  moveit_msgs::CollisionObject databaseObject(const std::string& id,
+                                              const std::string& dbName,
+                                              tf2::Transform xf,
+                                              ObjectDatabase& db);
+
+  tf2::Vector3 workspaceCenter;
+  double workspaceRadius;
+  int lastCulled;
+
+  // Database objects in the grid by name, with the sphere they were
+  // inserted with and the last build that saw them
+  struct Indexed {
+    int gridId;
+    tf2::Vector3 center;
+    double radius;
+    unsigned long stamp;
+  };
+  SpatialGrid grid;
+  std::unordered_map<std::string, Indexed> indexed;
+  // Snapshot object id for each grid id, as of the last build
+  std::vector<int> snapIds;
+  std::vector<int> freeGridIds;
+  unsigned long buildStamp;
+};
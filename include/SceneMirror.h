@@ -0,0 +1,62 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <unordered_set>
+
+#include <boost/functional/hash.hpp>
+
+#include "moveit_msgs/CollisionObject.h"
+
+// Local copy of the world collision objects that have been pushed to
+// move_group, so scene updates can be diffed without asking for the scene
+class SceneMirror {
+public:
+  struct Entry {
+    moveit_msgs::CollisionObject object;
+    std::size_t geometryDigest;
+    std::size_t poseDigest;
+  };
+
+  SceneMirror() : transThreshold(0.0), rotThreshold(0.0) {}
+
+  // Moves smaller than these (m, rad) are not sent, so that pose jitter
+  // does not cause a scene update
+  void setJitterThresholds(double trans, double rot);
+
+  // Replaces the whole mirror, eg with the scene move_group reports
+  void reset(const std::vector<moveit_msgs::CollisionObject>& world);
+
+  // Appends the ADD/MOVE/REMOVE operations that turn the mirror into
+  // requested to ops, leaving ignoreID alone. Returns false if there is
+  // nothing to send. The mirror itself is only changed by commit().
+  bool diff(const std::vector<moveit_msgs::CollisionObject>& requested,
+            const std::string& ignoreID,
+            const std::string& frame,
+            std::vector<moveit_msgs::CollisionObject>& ops);
+  // Records that the operations from the last diff have been applied
+  void commit();
+
+  bool lookup(const std::string& id, moveit_msgs::CollisionObject& co);
+  void add(const moveit_msgs::CollisionObject& co);
+  void remove(const std::string& id);
+  // Forces the next diff to MOVE this object
+  void invalidatePose(const std::string& id);
+  int size() { return objects.size(); }
+
+  static std::size_t geometryDigest(const moveit_msgs::CollisionObject& co);
+  static std::size_t poseDigest(const moveit_msgs::CollisionObject& co);
+
+private:
+  bool movedBeyondThresholds(const moveit_msgs::CollisionObject& from,
+                             const moveit_msgs::CollisionObject& to);
+
+  std::unordered_map<std::string, Entry> objects;
+  double transThreshold;
+  double rotThreshold;
+
+  // Changes from the last diff, waiting for commit()
+  std::vector<moveit_msgs::CollisionObject> pendingSet;
+  std::vector<std::string> pendingRemove;
+};
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <vector>
+#include <unordered_map>
+
+#include <tf2/LinearMath/Vector3.h>
+
+// Uniform grid over bounding spheres, for finding which objects could
+// touch a region without testing every object. Spheres can be moved and
+// removed, so one grid can follow a changing world.
+class SpatialGrid {
+public:
+  SpatialGrid(double cellSize = 0.25) : cell(cellSize), queryStamp(0) {}
+
+  void clear();
+  // Inserting an id that is already there moves it
+  void insert(int id, tf2::Vector3 center, double radius);
+  void remove(int id);
+  bool contains(int id) const { return slotOf.count(id) > 0; }
+
+  // Ids of the spheres that intersect the query sphere or box
+  std::vector<int> querySphere(tf2::Vector3 center, double radius);
+  std::vector<int> queryBox(tf2::Vector3 lo, tf2::Vector3 hi);
+
+private:
+  struct Item {
+    int id;
+    tf2::Vector3 center;
+    double radius;
+    unsigned int stamp;
+  };
+
+  long long cellKey(int x, int y, int z);
+  int cellIndex(double v) { return (int)floor(v / cell); }
+  bool sameCells(tf2::Vector3 a, tf2::Vector3 b)
+  {
+    return (cellIndex(a.x()) == cellIndex(b.x()) &&
+            cellIndex(a.y()) == cellIndex(b.y()) &&
+            cellIndex(a.z()) == cellIndex(b.z()));
+  }
+  void addToCells(int slot);
+  void removeFromCells(int slot);
+  // Items in the cells overlapping a box, each listed once
+  std::vector<int> candidates(tf2::Vector3 lo, tf2::Vector3 hi);
+
+  double cell;
+  unsigned int queryStamp;
+  std::vector<Item> items;
+  std::unordered_map<long long, std::vector<int> > cells;
+  // Index into items for each id, and items left by removed ids
+  std::unordered_map<int, int> slotOf;
+  std::vector<int> freeSlots;
+};
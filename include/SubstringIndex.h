@@ -0,0 +1,46 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <map>
+#include <unordered_map>
+#include <cstdint>
+
+// Trigram index over a set of names for the substring matching that
+// scene and database lookups do. Answers are the lexicographically first
+// matching name, which is what a scan over a std::map of the names would
+// find first, so swapping a scan for the index never changes the answer.
+class SubstringIndex {
+public:
+  SubstringIndex() {}
+  SubstringIndex(const std::vector<std::string>& names);
+
+  void add(const std::string& name);
+  void remove(const std::string& name);
+  void clear();
+  int size() const { return slots.size(); }
+  bool has(const std::string& name) const { return slots.count(name) > 0; }
+
+  // First name that contains query, "" if none
+  std::string firstContaining(const std::string& query) const;
+  // First name that is itself a substring of text, "" if none
+  std::string firstContainedIn(const std::string& text) const;
+  // First name matching either way, as the database does
+  std::string firstMatching(const std::string& s) const;
+
+private:
+  typedef uint32_t Gram;
+  static Gram gramAt(const std::string& s, int i);
+  // Slots of names that may contain query; all names for short queries
+  const std::vector<int>* candidates(const std::string& query) const;
+  void containedIn(const std::string& text, std::vector<int>& out) const;
+
+  // Slot per name, "" for freed slots
+  std::vector<std::string> names;
+  std::vector<int> freeSlots;
+  std::vector<int> allSlots;
+  std::unordered_map<std::string, int> slots;
+  std::unordered_map<Gram, std::vector<int> > postings;
+  // How many names have each length, so containedIn only tries those
+  std::map<int, int> lengths;
+};
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <random>
+#include <fstream>
+
+#include <ros/ros.h>
+#include <tf2_geometry_msgs/tf2_geometry_msgs.h>
+#include <tf2/utils.h>
+#include <shape_msgs/SolidPrimitive.h>
+
+#include "gazebo_msgs/ModelStates.h"
+
+// Random cluttered worlds for scaling tests, without Gazebo: database
+// entries in the object_info.json format, and model states that place
+// instances of them around the robot
+class SyntheticScene {
+public:
+  SyntheticScene(int models = 20, unsigned int seed = 1);
+
+  // Entries are named synthobj_00, synthobj_01, ..., each with top
+  // grasps at numGrasps evenly spaced yaws
+  bool writeDatabase(std::string fileName, int numGrasps = 1);
+
+  // The fetch at the origin, the ground, a table in front of it, and
+  // numObjects database objects on the table and scattered around it
+  gazebo_msgs::ModelStates makeStates(int numObjects);
+  // Moves every database object by up to amount in x and y
+  void jitter(gazebo_msgs::ModelStates& ms, double amount);
+
+  std::string modelName(int i);
+
+private:
+  std::mt19937 gen;
+  std::vector<shape_msgs::SolidPrimitive> shapes;
+};
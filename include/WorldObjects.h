@@ -1,7 +1,9 @@
 #pragma once
 
-#include <map>
 #include <string>
+#include <vector>
+#include <memory>
+#include <atomic>
 
 #include <tf2/utils.h>
 #include <boost/thread.hpp>
@@ -9,35 +11,71 @@
 #include <ros/ros.h>
 #include "gazebo_msgs/ModelStates.h"
 
+#include "WorldSnapshot.h"
+#include "PoseHistory.h"
+
 class WorldObjects {
 public:
- WorldObjects() : tableH(0.675) {}
+ WorldObjects();
+
+  // Fills a spare buffer and publishes it by storing its index; readers
+  // never wait on this. A zero stamp means now.
+  void update(const gazebo_msgs::ModelStates::ConstPtr& msg, ros::Time stamp = ros::Time());
 
-  void update(const gazebo_msgs::ModelStates::ConstPtr& msg);
+  // The latest world; take this once per command and read from it.
+  // Takes no lock: a reader only retries if an update lands while it
+  // is copying the pointer.
+  WorldSnapshot::ConstPtr snapshot();
 
-  int numObjects() { return objectPoses.size(); }
-  bool isInScene(std::string subName);
-  std::string nameInScene(std::string subName);
-  std::vector<std::string> allObjectNames();
+  int numObjects() { return snapshot()->numObjects(); }
+  // Counts calls to update, so callers can tell when the world changed
+  unsigned long version() { return snapshot()->version(); }
+  bool isInScene(std::string subName) { return snapshot()->isInScene(subName); }
+  std::string nameInScene(std::string subName) { return snapshot()->nameInScene(subName); }
+  std::vector<std::string> allObjectNames() { return snapshot()->allObjectNames(); }
 
-  tf2::Transform getXformOf(std::string name);
-  tf2::Vector3 getPositionOf(std::string name);
-  float getPosX(std::string name);
-  float getPosY(std::string name);
-  float getPosZ(std::string name);
-  tf2::Quaternion getRotationOf(std::string name);
+  tf2::Transform getXformOf(std::string name) { return snapshot()->getXformOf(name); }
+  tf2::Vector3 getPositionOf(std::string name) { return snapshot()->getPositionOf(name); }
+  float getPosX(std::string name) { return getPositionOf(name).x(); }
+  float getPosY(std::string name) { return getPositionOf(name).y(); }
+  float getPosZ(std::string name) { return getPositionOf(name).z(); }
+  tf2::Quaternion getRotationOf(std::string name) { return snapshot()->getRotationOf(name); }
 
-  tf2::Transform getWorldXform() { return worldXform; }
+  tf2::Transform getWorldXform() { return snapshot()->getWorldXform(); }
   float getTableH() { return tableH; }
 
-  tf2::Vector3 worldXformTimesPos(std::string name);
-  tf2::Quaternion worldXformTimesRot(std::string name);
-  tf2::Transform worldXformTimesTrans(std::string name);
+  tf2::Vector3 worldXformTimesPos(std::string name) { return snapshot()->worldXformTimesPos(name); }
+  tf2::Quaternion worldXformTimesRot(std::string name) { return snapshot()->worldXformTimesRot(name); }
+  tf2::Transform worldXformTimesTrans(std::string name) { return snapshot()->worldXformTimesTrans(name); }
+
+  // Recent poses, in the world (not robot) frame
+  bool getXformAt(const std::string& name, ros::Time t, tf2::Transform& xf) {
+    return history.getXformAt(name, t, xf);
+  }
+  bool isStationary(const std::string& name, ros::Time now, ros::Duration window,
+                    double trans, double rot) {
+    return history.isStationary(name, now, window, trans, rot);
+  }
 
 private:
-  std::map<std::string, tf2::Vector3> objectPoses;
-  std::map<std::string, tf2::Quaternion> objectRotations;
-  tf2::Transform worldXform;
+  typedef std::shared_ptr<WorldSnapshot> Buffer;
+  // Current plus one being filled plus one a slow reader may still hold
+  static const int NUM_BUFFERS = 3;
+
+  // pins counts readers between reading current and copying buf
+  struct Slot {
+    Buffer buf;
+    std::atomic<int> pins;
+  };
+
+  int spareSlot();
+
   float tableH;
-  boost::mutex objMutex;
+  unsigned long updates;
+  Slot slots[NUM_BUFFERS];
+  // Index of the published slot
+  std::atomic<int> current;
+  PoseHistory history;
+  // Serializes writers only; readers never take it
+  boost::mutex writeMutex;
 };
@@ -0,0 +1,84 @@
+#pragma once
+
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <memory>
+
+#include <ros/time.h>
+#include <tf2/utils.h>
+#include <tf2_geometry_msgs/tf2_geometry_msgs.h>
+
+#include "gazebo_msgs/ModelStates.h"
+
+#include "SubstringIndex.h"
+
+class WorldObjects;
+
+// The world as of one model_states message. It never changes once
+// published, so a command can hold one and read it as often as it likes
+// without locks.
+class WorldSnapshot {
+public:
+  typedef std::shared_ptr<const WorldSnapshot> ConstPtr;
+
+  WorldSnapshot() : ver(0), tableH(0.675), nameIndex(new SubstringIndex()) {
+    worldXform.setIdentity();
+  }
+  WorldSnapshot(const gazebo_msgs::ModelStates& msg, unsigned long version, float tableHeight);
+
+  unsigned long version() const { return ver; }
+  // When the message was received
+  ros::Time stamp() const { return received; }
+  int numObjects() const { return names.size(); }
+  bool isInScene(std::string subName) const;
+  std::string nameInScene(std::string subName) const;
+  std::vector<std::string> allObjectNames() const { return names; }
+
+  // Objects are interned to ids 0..numObjects()-1, in name order, when
+  // the snapshot is filled. Ids are only good for the snapshot they came
+  // from. idOf gives -1 for unknown names.
+  int idOf(const std::string& name) const;
+  const std::string& nameOf(int id) const { return names[id]; }
+  const tf2::Vector3& positionAt(int id) const { return positions[id]; }
+  const tf2::Quaternion& rotationAt(int id) const { return rotations[id]; }
+
+  // Unknown names give the identity / zero
+  tf2::Transform getXformOf(std::string name) const;
+  tf2::Vector3 getPositionOf(std::string name) const;
+  tf2::Quaternion getRotationOf(std::string name) const;
+
+  tf2::Transform getWorldXform() const { return worldXform; }
+  float getTableH() const { return tableH; }
+
+  tf2::Vector3 worldXformTimesPos(std::string name) const;
+  tf2::Quaternion worldXformTimesRot(std::string name) const;
+  tf2::Transform worldXformTimesTrans(std::string name) const;
+
+  // worldXform applied to every object in one pass, indexed by id
+  void worldPositions(std::vector<tf2::Vector3>& out) const;
+  void worldXforms(std::vector<tf2::Transform>& out) const;
+
+private:
+  friend class WorldObjects;
+
+  // Only WorldObjects refills, and only buffers no reader holds. Storage
+  // is reused, so a refill does not allocate once the buffer has grown.
+  // The name index is shared with previous when the object set is the
+  // same, and otherwise made from its index by adding and removing names.
+  void fill(const gazebo_msgs::ModelStates& msg, unsigned long version, float tableHeight,
+            const WorldSnapshot* previous = NULL);
+  void updateIndex(const WorldSnapshot* previous);
+
+  unsigned long ver;
+  ros::Time received;
+  // Structure of arrays, sorted by name
+  std::vector<std::string> names;
+  std::vector<tf2::Vector3> positions;
+  std::vector<tf2::Quaternion> rotations;
+  // Message indices in name order, scratch space for fill
+  std::vector<int> order;
+  std::shared_ptr<const SubstringIndex> nameIndex;
+  tf2::Transform worldXform;
+  float tableH;
+};
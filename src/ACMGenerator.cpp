@@ -0,0 +1,171 @@
+#include <string>
+#include <fstream>
+#include <map>
+
+#include <ros/ros.h>
+#include <moveit/robot_model_loader/robot_model_loader.h>
+#include <moveit/planning_scene/planning_scene.h>
+
+// Samples random robot configurations to find link pairs that never touch,
+// are adjacent, or always touch, and writes them out for ArmController
+class ACMGenerator {
+public:
+    typedef std::pair<std::string, std::string> LinkPair;
+
+    ACMGenerator() : numSamples(20000),
+                     alwaysFraction(0.95),
+                     outFile("allowed_collisions.txt"),
+                     loader("robot_description") {
+        n.getParam("/rosie_acm_generator/samples", numSamples);
+        n.getParam("/rosie_acm_generator/always_fraction", alwaysFraction);
+        n.getParam("/rosie_acm_generator/output_file", outFile);
+
+        model = loader.getModel();
+        if (!model) {
+            ROS_WARN("ACMGenerator could not load the robot model!");
+            return;
+        }
+        scene = std::make_shared<planning_scene::PlanningScene>(model);
+    }
+
+    bool ready() { return (bool)scene; }
+
+    void findAdjacent() {
+        // Links whose geometry is only separated by geometry-less links
+        // are attached to each other
+        std::vector<std::string> links = model->getLinkModelNamesWithCollisionGeometry();
+        for (int i = 0; i < links.size(); i++) {
+            const robot_model::LinkModel* lm = model->getLinkModel(links[i]);
+            const robot_model::LinkModel* parent = lm->getParentLinkModel();
+            while (parent && parent->getShapes().empty()) {
+                parent = parent->getParentLinkModel();
+            }
+            if (parent) reasons[orderedPair(lm->getName(), parent->getName())] = "adjacent";
+        }
+    }
+
+    void sample() {
+        std::vector<std::string> links = model->getLinkModelNamesWithCollisionGeometry();
+        std::map<LinkPair, int> hits;
+
+        collision_detection::AllowedCollisionMatrix checkAll;
+        collision_detection::CollisionRequest req;
+        req.contacts = true;
+        req.max_contacts = links.size()*links.size();
+        req.max_contacts_per_pair = 1;
+
+        robot_state::RobotState rs(model);
+        for (int i = 0; i < numSamples; i++) {
+            rs.setToRandomPositions();
+            rs.update();
+            collision_detection::CollisionResult res;
+            scene->getCollisionEnv()->checkSelfCollision(req, res, rs, checkAll);
+            for (collision_detection::CollisionResult::ContactMap::iterator c = res.contacts.begin();
+                 c != res.contacts.end(); c++) {
+                hits[orderedPair(c->first.first, c->first.second)]++;
+            }
+        }
+
+        int numNever = 0;
+        int numAlways = 0;
+        for (int a = 0; a < links.size(); a++) {
+            for (int b = a + 1; b < links.size(); b++) {
+                LinkPair lp = orderedPair(links[a], links[b]);
+                if (reasons.count(lp) > 0) continue;
+                int h = hits.count(lp) > 0 ? hits[lp] : 0;
+                if (h == 0) {
+                    reasons[lp] = "never";
+                    numNever++;
+                } else if (h >= alwaysFraction*numSamples) {
+                    reasons[lp] = "always";
+                    numAlways++;
+                }
+            }
+        }
+        ROS_INFO("ACMGenerator: %i samples, %i link pairs never collide, %i always do",
+                 numSamples, numNever, numAlways);
+    }
+
+    bool write() {
+        std::ofstream ofs(outFile);
+        if (!ofs) {
+            ROS_WARN("ACMGenerator could not open %s", outFile.c_str());
+            return false;
+        }
+        ofs << "# link_a link_b reason, from " << numSamples << " samples of "
+            << model->getName() << std::endl;
+        for (std::map<LinkPair, std::string>::iterator r = reasons.begin();
+             r != reasons.end(); r++) {
+            ofs << r->first.first << " " << r->first.second << " " << r->second << std::endl;
+        }
+        ofs.close();
+        ROS_INFO("ACMGenerator wrote %i allowed link pairs to %s",
+                 (int)reasons.size(), outFile.c_str());
+        return true;
+    }
+
+    // Self-collision cost per state with nothing allowed, with the SRDF's
+    // pairs, and with the SRDF's plus the generated ones
+    void benchmark() {
+        collision_detection::AllowedCollisionMatrix checkAll;
+        collision_detection::AllowedCollisionMatrix srdf = scene->getAllowedCollisionMatrix();
+        collision_detection::AllowedCollisionMatrix generated = srdf;
+        for (std::map<LinkPair, std::string>::iterator r = reasons.begin();
+             r != reasons.end(); r++) {
+            generated.setEntry(r->first.first, r->first.second, true);
+        }
+
+        int numStates = std::min(numSamples, 2000);
+        std::vector<robot_state::RobotState> states(numStates, robot_state::RobotState(model));
+        for (int i = 0; i < numStates; i++) {
+            states[i].setToRandomPositions();
+            states[i].update();
+        }
+
+        ROS_INFO("ACMGenerator self-collision check cost: none allowed %f us, SRDF %f us, generated %f us",
+                 timeChecks(states, checkAll),
+                 timeChecks(states, srdf),
+                 timeChecks(states, generated));
+    }
+
+private:
+    static LinkPair orderedPair(const std::string& a, const std::string& b) {
+        return (a < b ? std::make_pair(a, b) : std::make_pair(b, a));
+    }
+
+    double timeChecks(std::vector<robot_state::RobotState>& states,
+                      const collision_detection::AllowedCollisionMatrix& acm) {
+        collision_detection::CollisionRequest req;
+        ros::WallTime begin = ros::WallTime::now();
+        for (int i = 0; i < states.size(); i++) {
+            collision_detection::CollisionResult res;
+            scene->getCollisionEnv()->checkSelfCollision(req, res, states[i], acm);
+        }
+        return (ros::WallTime::now() - begin).toSec()*1e6 / states.size();
+    }
+
+    ros::NodeHandle n;
+    int numSamples;
+    double alwaysFraction;
+    std::string outFile;
+
+    robot_model_loader::RobotModelLoader loader;
+    robot_model::RobotModelConstPtr model;
+    planning_scene::PlanningScenePtr scene;
+    std::map<LinkPair, std::string> reasons;
+};
+
+int main(int argc, char** argv)
+{
+    ros::init(argc, argv, "rosie_acm_generator");
+    ACMGenerator gen;
+
+    if (!gen.ready()) return 1;
+
+    gen.findAdjacent();
+    gen.sample();
+    if (!gen.write()) return 1;
+    gen.benchmark();
+
+    return 0;
+}
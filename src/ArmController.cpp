@@ -100,30 +100,12 @@ std::vector<double> ArmController::clearanceData(moveit_msgs::RobotTrajectory tr
     // Only care about clearance if we get within 5cm of something
     double MAX_DIST_FOR_AVG = 0.05;
 
-    psm->requestPlanningSceneState();
-    planning_scene_monitor::LockedPlanningSceneRO ps(psm);
-    robot_state::RobotState rs(*group.getCurrentState());
-    collision_detection::CollisionEnvConstPtr cr = ps->getCollisionEnvUnpadded();
-
-    collision_detection::AllowedCollisionMatrix acm;
-    acm.clear();
-    acm.setDefaultEntry("ground", true);
+    std::vector<double> dists = waypointClearances(traj);
 
     double distSum = 0;
     double distMin = 1000;
     for (int i = 1; i < traj.joint_trajectory.points.size() - 1; i++) {
-        rs.setVariablePositions(traj.joint_trajectory.joint_names,
-                                traj.joint_trajectory.points[i].positions);
-        rs.updateCollisionBodyTransforms();
-
-        collision_detection::CollisionRequest req;
-        req.group_name = "arm";
-        req.distance = true;
-        req.verbose = true;
-        collision_detection::CollisionResult res;
-        ps->getCollisionEnv()->checkRobotCollision(req, res,
-                                                   rs, acm);
-        double resultDist = (res.distance < 0 ? 0 : res.distance);
+        double resultDist = dists[i];
 
         if (resultDist < MAX_DIST_FOR_AVG) {
             distSum += (MAX_DIST_FOR_AVG - resultDist)/MAX_DIST_FOR_AVG;
@@ -141,13 +123,66 @@ std::vector<double> ArmController::clearanceData(moveit_msgs::RobotTrajectory tr
     return dataVals;
 }
 
+// Distance to the nearest obstacle at every waypoint, never negative
+std::vector<double> ArmController::waypointClearances(moveit_msgs::RobotTrajectory& traj) {
+    if (traj.joint_trajectory.points.size() == 0) return std::vector<double>();
+
+    robot_state::RobotState rs(monitoredState());
+    boost::shared_lock<boost::shared_mutex> local(localMutex);
+    return waypointClearances((distanceScene ? distanceScene : localScene).get(), localACM, rs, traj);
+}
+
+// Same, in any scene, with the joints not in traj taken from rs. Touches
+// no members, so planner threads can call it on their own copies.
+std::vector<double> ArmController::waypointClearances(const planning_scene::PlanningScene* scene,
+                                                      const collision_detection::AllowedCollisionMatrix& acm,
+                                                      robot_state::RobotState rs,
+                                                      moveit_msgs::RobotTrajectory& traj) {
+    std::vector<double> dists;
+
+    collision_detection::CollisionRequest req;
+    req.group_name = "arm";
+    req.distance = true;
+    req.verbose = true;
+
+    for (int i = 0; i < traj.joint_trajectory.points.size(); i++) {
+        rs.setVariablePositions(traj.joint_trajectory.joint_names,
+                                traj.joint_trajectory.points[i].positions);
+        rs.updateCollisionBodyTransforms();
+
+        collision_detection::CollisionResult res;
+        scene->getCollisionEnv()->checkRobotCollision(req, res,
+                                                      rs, acm);
+        dists.push_back(res.distance < 0 ? 0 : res.distance);
+    }
+    return dists;
+}
+
 ArmController::ArmController(ros::NodeHandle& nh, bool rep) : isReplay(rep),
                                                               numRetries(2),
                                                               checkPlans(true),
                                                               group("arm"),
                                                               gripper("gripper_controller/gripper_action", true),
                                                               plannerPlugin(UNKNOWNL),
-                                                              plannerName(UNKNOWN)
+                                                              plannerName(UNKNOWN),
+                                                              velocityScaling(0.4),
+                                                              adaptiveSpeed(false),
+                                                              waypointTolerance(0.0),
+                                                              regionSamples(64),
+                                                              regionTopK(4),
+                                                              directPaths(true),
+                                                              directQueries(0),
+                                                              directHits(0),
+                                                              sceneVersion(0),
+                                                              pinnedVersion(0),
+                                                              dualPlanning(false),
+                                                              dualGrace(0.5),
+                                                              dualMinClearance(0.01),
+                                                              diffsTagged(0),
+                                                              diffApplied(0),
+                                                              diffMonitored(0),
+                                                              stopPlanWorkers(false),
+                                                              settleTimeout(0.0)
 {
     std::time_t t;
     std::time(&t);
@@ -178,8 +213,16 @@ ArmController::ArmController(ros::NodeHandle& nh, bool rep) : isReplay(rep),
     ofs.close();
     ROS_INFO("Logging motion history to %s", logFileName.c_str());
 
-    group.setMaxVelocityScalingFactor(0.4);
+    group.setMaxVelocityScalingFactor(velocityScaling);
     group.setEndEffectorLink("gripper_link");
+
+    // Default curve: slowest near contact, full speed 25cm from everything
+    curveClearances.push_back(0.0);
+    curveScales.push_back(0.2);
+    curveClearances.push_back(0.05);
+    curveScales.push_back(0.4);
+    curveClearances.push_back(0.25);
+    curveScales.push_back(1.0);
     gripper.waitForServer();
     closeGripper();
     grabbedObject.id = "NONE";
@@ -200,8 +243,46 @@ ArmController::ArmController(ros::NodeHandle& nh, bool rep) : isReplay(rep),
 
     planRequestClient = nh.serviceClient<moveit_msgs::GetMotionPlan>("plan_kinematic_path");
     planRequestClient.waitForExistence();
+    for (int i = 0; i < PLAN_WORKERS; i++) {
+        planWorkers.create_thread(boost::bind(&ArmController::planWorkerLoop, this));
+    }
 
+    // Keep a live copy of move_group's scene: one full request, then diffs
+    // and joint states as they arrive
     psm = std::make_shared<planning_scene_monitor::PlanningSceneMonitor>("robot_description");
+    psm->addUpdateCallback(boost::bind(&ArmController::sceneMonitorUpdated, this, _1));
+    psm->requestPlanningSceneState(move_group::GET_PLANNING_SCENE_SERVICE_NAME);
+    psm->startSceneMonitor("/move_group/monitored_planning_scene");
+    psm->startStateMonitor();
+
+    // A model, and so a kinematics solver, for each IK worker
+    int ikWorkers = std::max(1, (int)boost::thread::hardware_concurrency());
+    for (int i = 0; i < ikWorkers; i++) {
+        robot_model_loader::RobotModelLoader loader("robot_description");
+        ikModels.push_back(loader.getModel());
+    }
+
+    localScene = std::make_shared<planning_scene::PlanningScene>(psm->getRobotModel());
+    {
+        planning_scene_monitor::LockedPlanningSceneRO ps(psm);
+        localScene->getCollisionEnvNonConst()->setLinkPadding(ps->getCollisionEnv()->getLinkPadding());
+        localScene->getCollisionEnvNonConst()->setLinkScale(ps->getCollisionEnv()->getLinkScale());
+    }
+
+    // Start the mirror from whatever move_group already has
+    moveit_msgs::GetPlanningScene::Request getRequest;
+    moveit_msgs::GetPlanningScene::Response getResponse;
+    getRequest.components.components = getRequest.components.WORLD_OBJECT_GEOMETRY;
+    if (getPSClient.call(getRequest, getResponse)) {
+        sceneMirror.reset(getResponse.scene.world.collision_objects);
+        applyToLocalWorld(localScene, objData.get(), getResponse.scene.world.collision_objects);
+    } else {
+        ROS_WARN("Requesting the current collision scene failed!!");
+    }
+
+    // Self collisions use the SRDF's pairs until a generated file is loaded
+    localACM = localScene->getAllowedCollisionMatrix();
+    localACM.setDefaultEntry("ground", true);
 }
 
 void ArmController::setLibrary(std::string l) {
@@ -264,150 +345,345 @@ void ArmController::setPlanningTime(double t) {
   ROS_INFO("ArmController will plan for %f s", planningTime);
 }
 
-std::string ArmController::armPlanningFrame() {
-    return group.getPlanningFrame();
+void ArmController::setAdaptiveSpeed(bool on) {
+    adaptiveSpeed = on;
+    // Plans are timed at full speed and slowed down per segment at execution
+    if (adaptiveSpeed) {
+        velocityScaling = 1.0;
+        ROS_INFO("ArmController will scale speed with obstacle clearance");
+    } else {
+        velocityScaling = 0.4;
+    }
+    group.setMaxVelocityScalingFactor(velocityScaling);
 }
 
-void ArmController::setGripperClosed(bool isClosed) {
-    if (!gripperClosed && isClosed) {
-        ROS_INFO("Gripper now CLOSED");
+void ArmController::setSpeedCurve(std::vector<double> clearances,
+                                  std::vector<double> scales) {
+    if (clearances.size() == 0 || clearances.size() != scales.size()) {
+        ROS_WARN("Speed curve needs the same nonzero number of clearances and scales!");
+        return;
     }
-    if (gripperClosed && !isClosed) {
-        ROS_INFO("Gripper now OPEN");
+    for (int i = 0; i < clearances.size(); i++) {
+        if (scales[i] <= 0 || scales[i] > 1.0) {
+            ROS_WARN("Speed curve scales must be in (0, 1]!");
+            return;
+        }
+        if (i > 0 && clearances[i] <= clearances[i-1]) {
+            ROS_WARN("Speed curve clearances must be increasing!");
+            return;
+        }
     }
-    gripperClosed = isClosed;
+    curveClearances = clearances;
+    curveScales = scales;
 }
 
-void ArmController::updateCollisionScene(std::vector<moveit_msgs::CollisionObject> cos) {
-    moveit_msgs::GetPlanningScene::Request getRequest;
-    moveit_msgs::GetPlanningScene::Response getResponse;
+void ArmController::setSceneJitterThresholds(double trans, double rot) {
+    boost::lock_guard<boost::mutex> guard(sceneMutex);
+    sceneMirror.setJitterThresholds(trans, rot);
+}
 
-    getRequest.components.components = getRequest.components.WORLD_OBJECT_GEOMETRY;
-    if (!getPSClient.call(getRequest, getResponse)) {
-        ROS_WARN("Requesting the current collision scene failed!!");
-        return;
+// move_group keeps the name of the last diff it applied and publishes it
+// with its monitored scene, so the name says which of our diffs the
+// monitor has seen, whatever else has changed since
+void ArmController::sceneMonitorUpdated(planning_scene_monitor::PlanningSceneMonitor::SceneUpdateType type) {
+    // Full scene updates include the geometry bit too, and all of our
+    // diffs change geometry
+    if (!(type & planning_scene_monitor::PlanningSceneMonitor::UPDATE_GEOMETRY)) return;
+
+    std::string name;
+    {
+        planning_scene_monitor::LockedPlanningSceneRO ps(psm);
+        name = ps->getName();
+    }
+    std::string prefix = "rosie_motion_diff_";
+    if (name.compare(0, prefix.size(), prefix) != 0) return;
+    unsigned long seen = strtoul(name.c_str() + prefix.size(), NULL, 10);
+
+    boost::lock_guard<boost::mutex> guard(monitorMutex);
+    if (seen > diffMonitored) diffMonitored = seen;
+    monitorCond.notify_all();
+}
+
+// Names a scene diff with the next sequence number, which is returned
+unsigned long ArmController::tagSceneDiff(moveit_msgs::PlanningScene& diff) {
+    boost::lock_guard<boost::mutex> guard(monitorMutex);
+    std::stringstream ss;
+    ss << "rosie_motion_diff_" << ++diffsTagged;
+    diff.name = ss.str();
+    return diffsTagged;
+}
+
+// Once move_group has accepted a diff, it has to show up in the monitor
+// before local checks use it
+void ArmController::sceneDiffApplied(unsigned long diff) {
+    boost::lock_guard<boost::mutex> guard(monitorMutex);
+    if (diff > diffApplied) diffApplied = diff;
+}
+
+bool ArmController::waitForSceneMonitor(double timeout) {
+    boost::unique_lock<boost::mutex> lock(monitorMutex);
+    while (diffMonitored < diffApplied) {
+        if (!monitorCond.timed_wait(lock, boost::posix_time::milliseconds((int)(timeout*1000)))) {
+            ROS_WARN("Planning scene monitor has not caught up with the last scene update!");
+            return false;
+        }
+    }
+    return true;
+}
+
+// Reads link pairs written by acmgenerator ("link_a link_b reason" per
+// line) into the ACM used for local checks, and into the ACM move_group
+// and the local planning scenes use for their own self checks
+bool ArmController::loadAllowedCollisions(std::string fileName) {
+    std::ifstream ifs(fileName);
+    if (!ifs) {
+        ROS_WARN("Could not open allowed collision file %s", fileName.c_str());
+        return false;
+    }
+
+    std::vector<std::pair<std::string, std::string> > pairs;
+    std::string line;
+    while (std::getline(ifs, line)) {
+        if (line.empty() || line[0] == '#') continue;
+        std::istringstream ls(line);
+        std::string a, b;
+        if (!(ls >> a >> b)) continue;
+        pairs.push_back(std::make_pair(a, b));
+    }
+
+    // Without the ground entry, which is only for local checks
+    collision_detection::AllowedCollisionMatrix planACM;
+    {
+        planning_scene_monitor::LockedPlanningSceneRO ps(psm);
+        planACM = ps->getAllowedCollisionMatrix();
+    }
+    for (int i = 0; i < pairs.size(); i++) {
+        planACM.setEntry(pairs[i].first, pairs[i].second, true);
     }
 
     moveit_msgs::ApplyPlanningScene::Request applyRequest;
     moveit_msgs::ApplyPlanningScene::Response applyResponse;
     applyRequest.scene.is_diff = true;
+    applyRequest.scene.robot_state.is_diff = true;
+    planACM.getMessage(applyRequest.scene.allowed_collision_matrix);
+    unsigned long diff = tagSceneDiff(applyRequest.scene);
+    psDiffClient.call(applyRequest, applyResponse);
+    if (!applyResponse.success) {
+        ROS_WARN("Sending the allowed collisions to move_group failed!!");
+    } else {
+        sceneDiffApplied(diff);
+    }
 
-    // Check if scene objects need to be updated or removed
-    for (std::size_t i = 0; i < getResponse.scene.world.collision_objects.size(); i++) {
-        // Don't change anything about the held object
-        if (grabbedObject.id.compare(getResponse.scene.world.collision_objects[i].id) == 0) {
-            continue;
-        }
+    boost::unique_lock<boost::shared_mutex> lock(localMutex);
+    for (int i = 0; i < pairs.size(); i++) {
+        localACM.setEntry(pairs[i].first, pairs[i].second, true);
+    }
+    localScene->getAllowedCollisionMatrixNonConst() = planACM;
+    if (unpaddedScene) unpaddedScene->getAllowedCollisionMatrixNonConst() = planACM;
+    ROS_INFO("ArmController allows %i link pairs from %s", (int)pairs.size(), fileName.c_str());
+    return true;
+}
 
-        // See if object in the world matches object in requested list
-        bool matched = false;
-        for (std::vector<moveit_msgs::CollisionObject>::iterator j = cos.begin();
-             j != cos.end(); j++) {
-            if (j->id.compare(getResponse.scene.world.collision_objects[i].id) != 0)
-                continue;
-
-            // If so, update its position
-            matched = true;
-
-            // Check to see if we also need to change the size, ie has its database
-            // entry been edited
-            bool sizeChanged = false;
-            for (int p = 0; p < j->primitives.size(); p++) {
-                for (int k = 0; k < j->primitives[p].dimensions.size(); k++) {
-                    if (j->primitives[p].dimensions[k] !=
-                        getResponse.scene.world.collision_objects[i].primitives[p].dimensions[k]) {
-                        sizeChanged = true;
-                        break;
-                    }
-                }
-            }
+bool ArmController::setCollisionBackend(std::string name) {
+    collision_detection::CollisionDetectorAllocatorPtr alloc = collisionAllocator(name);
+    if (!alloc) {
+        ROS_WARN("Unknown collision backend %s, keeping %s", name.c_str(),
+                 localScene->getActiveCollisionDetectorName().c_str());
+        return false;
+    }
 
-            // To change the size, you have to remove it and add again
-            if (sizeChanged) {
-                moveit_msgs::CollisionObject removal;
-                removal.header.frame_id = armPlanningFrame();
-                removal.id = getResponse.scene.world.collision_objects[i].id;
-                removal.operation = removal.REMOVE;
-                applyRequest.scene.world.collision_objects.push_back(removal);
-                moveit_msgs::CollisionObject newObj = *j;
-                newObj.header.frame_id = armPlanningFrame();
-                newObj.operation = newObj.ADD;
-                applyRequest.scene.world.collision_objects.push_back(newObj);
-            }
-            // Otherwise you can just move it
-            else {
-                moveit_msgs::CollisionObject edits;
-                edits.header.frame_id = armPlanningFrame();
-                edits.id = j->id;
-                edits.operation = edits.MOVE;
-                for (int p = 0; p < j->primitive_poses.size(); p++) {
-                    edits.primitive_poses.push_back(j->primitive_poses[p]);
-                }
-                applyRequest.scene.world.collision_objects.push_back(edits);
-            }
-            break;
-        }
+    // The new detector shares the world and copies the padding
+    boost::unique_lock<boost::shared_mutex> lock(localMutex);
+    localScene->allocateCollisionDetector(alloc);
+    if (unpaddedScene) unpaddedScene->allocateCollisionDetector(alloc);
+    updateDistanceScenes();
+    ROS_INFO("ArmController local checks use the %s collision detector",
+             localScene->getActiveCollisionDetectorName().c_str());
+    if (distanceScene)
+        ROS_INFO("ArmController clearances still use FCL, %s does not compute distances",
+                 localScene->getActiveCollisionDetectorName().c_str());
+    return true;
+}
 
-        // Otherwise it must have disappeared, remove it
-        if (!matched) {
-            moveit_msgs::CollisionObject removal;
-            removal.header.frame_id = armPlanningFrame();
-            removal.id = getResponse.scene.world.collision_objects[i].id;
-            removal.operation = removal.REMOVE;
-            applyRequest.scene.world.collision_objects.push_back(removal);
-        }
+// Bullet leaves CollisionResult::distance at DBL_MAX, so clearances come
+// from FCL scenes that share the local worlds. Call with localMutex held.
+void ArmController::updateDistanceScenes() {
+    distanceScene.reset();
+    unpaddedDistanceScene.reset();
+    if (localScene->getActiveCollisionDetectorName() == "FCL") return;
+
+    planning_scene::PlanningScenePtr* scenes[2] = {&localScene, &unpaddedScene};
+    planning_scene::PlanningScenePtr* dists[2] = {&distanceScene, &unpaddedDistanceScene};
+    for (int i = 0; i < 2; i++) {
+        if (!*scenes[i]) continue;
+        planning_scene::PlanningScenePtr ds = std::make_shared<planning_scene::PlanningScene>(
+            psm->getRobotModel(), (*scenes[i])->getWorldNonConst());
+        ds->allocateCollisionDetector(collisionAllocator("fcl"));
+        ds->getCollisionEnvNonConst()->setLinkPadding((*scenes[i])->getCollisionEnv()->getLinkPadding());
+        ds->getCollisionEnvNonConst()->setLinkScale((*scenes[i])->getCollisionEnv()->getLinkScale());
+        *dists[i] = ds;
+    }
+}
+
+ros::Time ArmController::currentStateStamp() {
+    return psm->getStateMonitor()->getCurrentStateTime();
+}
+
+// A copy taken under sceneMutex, since attach and detach change it
+std::string ArmController::getHeld() {
+    boost::lock_guard<boost::mutex> guard(sceneMutex);
+    return grabbedObject.id;
+}
+
+unsigned long ArmController::loggedSceneVersion() {
+    boost::lock_guard<boost::mutex> guard(sceneMutex);
+    return sceneVersion;
+}
+
+// Current robot state, including attached objects, once the monitor has
+// seen our last scene change
+robot_state::RobotState ArmController::monitoredState() {
+    waitForSceneMonitor();
+    planning_scene_monitor::LockedPlanningSceneRO ps(psm);
+    return ps->getCurrentState();
+}
+
+// Database objects get the shapes ObjectDatabase built at load; anything
+// else (the table, ground, or objects from a bag) is built from the message
+std::vector<shapes::ShapeConstPtr> ArmController::localShapesFor(const moveit_msgs::CollisionObject& co,
+                                                                 ObjectDatabase* db) {
+    if (db && co.type.key != "") {
+        const std::vector<shapes::ShapeConstPtr>& cached = db->getCollisionShapes(co.type.key);
+        if (cached.size() == co.primitives.size()) return cached;
+    }
+
+    std::vector<shapes::ShapeConstPtr> built;
+    for (int i = 0; i < co.primitives.size(); i++) {
+        built.push_back(shapes::ShapeConstPtr(shapes::constructShapeFromMsg(co.primitives[i])));
     }
+    return built;
+}
 
-    // Check if vector contains entirely new objects
-    for (std::vector<moveit_msgs::CollisionObject>::iterator j = cos.begin();
-         j != cos.end(); j++) {
-        if (grabbedObject.id.compare(j->id) == 0) {
-            continue;
+void ArmController::applyToLocalWorld(planning_scene::PlanningScenePtr scene,
+                                      ObjectDatabase* db,
+                                      const std::vector<moveit_msgs::CollisionObject>& ops) {
+    boost::unique_lock<boost::shared_mutex> lock(localMutex);
+    collision_detection::WorldPtr w = scene->getWorldNonConst();
+    for (int i = 0; i < ops.size(); i++) {
+        const moveit_msgs::CollisionObject& co = ops[i];
+        EigenSTL::vector_Isometry3d poses;
+        for (int j = 0; j < co.primitive_poses.size(); j++) {
+            const geometry_msgs::Pose& p = co.primitive_poses[j];
+            Eigen::Isometry3d pose = Eigen::Translation3d(p.position.x, p.position.y, p.position.z) *
+                Eigen::Quaterniond(p.orientation.w, p.orientation.x,
+                                   p.orientation.y, p.orientation.z).normalized();
+            poses.push_back(pose);
         }
 
-        bool isNewObj = true;
-        for (std::size_t i = 0; i < getResponse.scene.world.collision_objects.size();
-             i++) {
-            if (j->id.compare(getResponse.scene.world.collision_objects[i].id) == 0) {
-                isNewObj = false;
-                break;
+        if (co.operation == co.REMOVE) {
+            w->removeObject(co.id);
+        }
+        else if (co.operation == co.MOVE) {
+            // Moving keeps the shapes and only changes their poses
+            collision_detection::World::ObjectConstPtr obj = w->getObject(co.id);
+            if (!obj) continue;
+            for (int j = 0; j < obj->shapes_.size() && j < poses.size(); j++) {
+                w->moveShapeInObject(co.id, obj->shapes_[j], poses[j]);
             }
         }
+        else {
+            std::vector<shapes::ShapeConstPtr> shapeVec = localShapesFor(co, db);
+            if (shapeVec.size() != poses.size()) continue;
+            w->removeObject(co.id);
+            w->addToObject(co.id, shapeVec, poses);
+        }
+    }
+}
 
-        if (!isNewObj) continue;
+std::string ArmController::armPlanningFrame() {
+    return group.getPlanningFrame();
+}
 
-        // Add object to the scene if it is new
-        moveit_msgs::CollisionObject newObj = *j;
-        newObj.header.frame_id = armPlanningFrame();
-        newObj.operation = newObj.ADD;
-        applyRequest.scene.world.collision_objects.push_back(newObj);
+void ArmController::setGripperClosed(bool isClosed) {
+    if (!gripperClosed && isClosed) {
+        ROS_INFO("Gripper now CLOSED");
+    }
+    if (gripperClosed && !isClosed) {
+        ROS_INFO("Gripper now OPEN");
     }
+    gripperClosed = isClosed;
+}
 
+void ArmController::pinScene(unsigned long worldVersion) {
+    boost::lock_guard<boost::mutex> guard(sceneMutex);
+    pinnedVersion = worldVersion;
+}
+
+void ArmController::unpinScene() {
+    boost::lock_guard<boost::mutex> guard(sceneMutex);
+    pinnedVersion = 0;
+}
+
+bool ArmController::scenePinned() {
+    boost::lock_guard<boost::mutex> guard(sceneMutex);
+    return pinnedVersion != 0;
+}
+
+// Called both by commands and by MotionServer's scene sync thread
+bool ArmController::updateCollisionScene(std::vector<moveit_msgs::CollisionObject> cos,
+                                         unsigned long worldVersion) {
+    boost::lock_guard<boost::mutex> guard(sceneMutex);
+    if (pinnedVersion != 0 && worldVersion != pinnedVersion) return false;
+
+    moveit_msgs::ApplyPlanningScene::Request applyRequest;
+    moveit_msgs::ApplyPlanningScene::Response applyResponse;
+    applyRequest.scene.is_diff = true;
+
+    // Don't change anything about the held object. No difference means
+    // the scene already matches this version.
+    if (!sceneMirror.diff(cos, grabbedObject.id, armPlanningFrame(),
+                          applyRequest.scene.world.collision_objects)) {
+        sceneVersion = worldVersion;
+        return true;
+    }
+
+    unsigned long diff = tagSceneDiff(applyRequest.scene);
     psDiffClient.call(applyRequest, applyResponse);
     if (!applyResponse.success) {
         ROS_WARN("Updating the collision scene failed!!");
-    } else {
-        if (!isReplay)
-            bagFile.write("scenes", ros::Time::now(), applyRequest.scene.world);
+        return false;
+    }
+    sceneDiffApplied(diff);
+    sceneMirror.commit();
+    sceneVersion = worldVersion;
+    applyToLocalWorld(localScene, objData.get(), applyRequest.scene.world.collision_objects);
+    if (!isReplay) {
+        boost::lock_guard<boost::mutex> bag(bagMutex);
+        bagFile.write("scenes", ros::Time::now(), applyRequest.scene.world);
     }
+    return true;
 }
 
-void ArmController::attachToGripper(std::string objName) {
-    moveit_msgs::GetPlanningScene::Request getRequest;
-    moveit_msgs::GetPlanningScene::Response getResponse;
-
-    getRequest.components.components = getRequest.components.WORLD_OBJECT_GEOMETRY;
-    if (!getPSClient.call(getRequest, getResponse)) {
-        ROS_WARN("Requesting the current collision scene failed!!");
-        return;
-    }
+// The unpadded world only lives here, so there is nothing to send
+bool ArmController::updateUnpaddedScene(std::vector<moveit_msgs::CollisionObject> cos,
+                                        unsigned long worldVersion) {
+    boost::lock_guard<boost::mutex> guard(sceneMutex);
+    if (!unpaddedScene) return true;
+    if (pinnedVersion != 0 && worldVersion != pinnedVersion) return false;
+
+    std::vector<moveit_msgs::CollisionObject> ops;
+    if (!unpaddedMirror.diff(cos, grabbedObject.id, armPlanningFrame(), ops)) return true;
+    unpaddedMirror.commit();
+    applyToLocalWorld(unpaddedScene, unpaddedData.get(), ops);
+    return true;
+}
 
+void ArmController::attachToGripper(std::string objName) {
+    boost::lock_guard<boost::mutex> guard(sceneMutex);
     moveit_msgs::CollisionObject co;
-    for (std::size_t i = 0; i < getResponse.scene.world.collision_objects.size(); i++) {
-        if (objName.compare(getResponse.scene.world.collision_objects[i].id) == 0) {
-            co = getResponse.scene.world.collision_objects[i];
-            break;
-        }
+    if (!sceneMirror.lookup(objName, co)) {
+        ROS_WARN("Object %s is not in the collision scene!!", objName.c_str());
+        return;
     }
 
     moveit_msgs::ApplyPlanningScene::Request applyRequest;
@@ -423,20 +699,30 @@ void ArmController::attachToGripper(std::string objName) {
     toAttach.touch_links.push_back("r_gripper_finger_link");
     toAttach.touch_links.push_back("gripper_link");
     toAttach.object = co;
+    toAttach.object.header.frame_id = armPlanningFrame();
     toAttach.object.operation = toAttach.object.ADD;
     applyRequest.scene.robot_state.is_diff = true;
     applyRequest.scene.robot_state.attached_collision_objects.push_back(toAttach);
 
+    unsigned long diff = tagSceneDiff(applyRequest.scene);
     psDiffClient.call(applyRequest, applyResponse);
     if (!applyResponse.success) {
         ROS_WARN("Updating the collision scene with attached object failed!!");
     }
     else {
+        sceneDiffApplied(diff);
         grabbedObject = co;
+        // Attaching takes it out of the world
+        sceneMirror.remove(objName);
+        unpaddedMirror.remove(objName);
+        boost::unique_lock<boost::shared_mutex> lock(localMutex);
+        localScene->getWorldNonConst()->removeObject(objName);
+        if (unpaddedScene) unpaddedScene->getWorldNonConst()->removeObject(objName);
     }
 }
 
 void ArmController::detachHeldObject() {
+    boost::lock_guard<boost::mutex> guard(sceneMutex);
     moveit_msgs::ApplyPlanningScene::Request applyRequest;
     moveit_msgs::ApplyPlanningScene::Response applyResponse;
     applyRequest.scene.is_diff = true;
@@ -450,11 +736,26 @@ void ArmController::detachHeldObject() {
     toDetach.object.operation = toDetach.object.REMOVE;
     applyRequest.scene.robot_state.attached_collision_objects.push_back(toDetach);
 
+    unsigned long diff = tagSceneDiff(applyRequest.scene);
     psDiffClient.call(applyRequest, applyResponse);
     if (!applyResponse.success) {
         ROS_WARN("Updating the collision scene with attached object failed!!");
     }
     else {
+        sceneDiffApplied(diff);
+        // Detaching puts it back in the world where it was let go, which
+        // the mirror does not know yet
+        sceneMirror.add(grabbedObject);
+        sceneMirror.invalidatePose(grabbedObject.id);
+        grabbedObject.operation = grabbedObject.ADD;
+        applyToLocalWorld(localScene, objData.get(),
+                          std::vector<moveit_msgs::CollisionObject>(1, grabbedObject));
+        if (unpaddedScene) {
+            unpaddedMirror.add(grabbedObject);
+            unpaddedMirror.invalidatePose(grabbedObject.id);
+            applyToLocalWorld(unpaddedScene, unpaddedData.get(),
+                              std::vector<moveit_msgs::CollisionObject>(1, grabbedObject));
+        }
         grabbedObject = moveit_msgs::CollisionObject();
         grabbedObject.id = "NONE";
     }
@@ -477,9 +778,26 @@ void ArmController::setGripperTo(float m) {
     gripper.waitForResult(ros::Duration(2.0));
 }
 
+// Waits until name has stopped moving, giving up after settleTimeout.
+// Without a settle check this is the old fixed sleep.
+void ArmController::waitForSettled(const std::string& name, double fallback) {
+    if (!settleCheck || name == "" || name == "NONE") {
+        ros::Duration(fallback).sleep();
+        return;
+    }
+
+    ros::WallTime begin = ros::WallTime::now();
+    while (!settleCheck(name)) {
+        if ((ros::WallTime::now() - begin).toSec() > settleTimeout) {
+            ROS_WARN("%s has not settled after %f s, carrying on", name.c_str(), settleTimeout);
+            return;
+        }
+        ros::WallDuration(0.02).sleep();
+    }
+}
+
 bool ArmController::pickUp(tf2::Transform objXform,
-                           std::vector<std::pair<tf2::Transform,
-                           tf2::Transform> > graspList,
+                           const std::vector<GraspPair>& graspList,
                            std::string objName) {
     tf2::Transform firstPose;
     int graspIndex = -1;
@@ -495,17 +813,17 @@ bool ArmController::pickUp(tf2::Transform objXform,
     if (graspIndex == -1) return false;
     if (!executeCurrentPlan()) return false;
 
-    ros::Duration(1.0).sleep();
+    waitForSettled(objName, 1.0);
     openGripper();
-    ros::Duration(0.5).sleep();
+    waitForSettled(objName, 0.5);
 
     setCurrentGoalTo(objXform*graspList.at(0).second);
     if (!planStraightLineMotion(objXform*graspList.at(graspIndex).second)) return false;
     if (!executeCurrentPlan()) return false;
 
-    ros::Duration(0.5).sleep();
+    waitForSettled(objName, 0.5);
     closeGripper();
-    ros::Duration(0.5).sleep();
+    waitForSettled(objName, 0.5);
 
     if (gripperClosed) {
         ROS_INFO("Arm will return home because grasping the object failed.");
@@ -528,6 +846,7 @@ bool ArmController::pickUp(tf2::Transform objXform,
     if (gripperClosed) {
         ROS_INFO("Arm seems to have dropped the object it was holding.");
         detachHeldObject();
+        boost::lock_guard<boost::mutex> guard(sceneMutex);
         grabbedObject = moveit_msgs::CollisionObject();
         grabbedObject.id = "NONE";
         return false;
@@ -537,7 +856,7 @@ bool ArmController::pickUp(tf2::Transform objXform,
 }
 
 bool ArmController::putDownHeldObj(std::vector<tf2::Transform> targets) {
-    if (grabbedObject.id == "NONE") {
+    if (getHeld() == "NONE") {
         ROS_WARN("Trying to put down an object with no object in hand!!");
         return false;
     }
@@ -546,11 +865,15 @@ bool ArmController::putDownHeldObj(std::vector<tf2::Transform> targets) {
     // Targets refer to tabletop height, we want object height, and also
     // you want to always drop off at a little higher than you picked up...
     float zAdjust = 0.5;
-    shape_msgs::SolidPrimitive sp = grabbedObject.primitives[0];
-    if (grabbedObject.primitives[0].type == grabbedObject.primitives[0].BOX) {
+    shape_msgs::SolidPrimitive sp;
+    {
+        boost::lock_guard<boost::mutex> guard(sceneMutex);
+        if (!grabbedObject.primitives.empty()) sp = grabbedObject.primitives[0];
+    }
+    if (sp.type == sp.BOX) {
         zAdjust *= (sp.dimensions[2] + 0.05);
     }
-    else if (grabbedObject.primitives[0].type == grabbedObject.primitives[0].CYLINDER) {
+    else if (sp.type == sp.CYLINDER) {
         zAdjust *= (sp.dimensions[0] + 0.05);
     }
 
@@ -561,49 +884,96 @@ bool ArmController::putDownHeldObj(std::vector<tf2::Transform> targets) {
         i->setOrigin(v);
     }
 
-    bool ok = false;
-    tf2::Transform firstPose;
-    int targetIndex = 0;
+    // Solve IK for every target at once and plan to all reachable ones,
+    // keeping the one closest to the requested target that succeeds
+    std::vector<geometry_msgs::Pose> firstPoses;
     for (std::vector<tf2::Transform>::iterator i = targets.begin();
          i != targets.end(); i++) {
-        firstPose = (*i)*prevObjRotation*usedGrasp.first;
-        setCurrentGoalTo(firstPose);
-        if (planToXform(firstPose, numRetries)) {
-            ok = true;
-            break;
-        }
-        targetIndex++;
+        tf2::Transform fp = (*i)*prevObjRotation*usedGrasp.first;
+        geometry_msgs::Pose pose;
+        pose.orientation = tf2::toMsg(fp.getRotation());
+        pose.position.x = fp.getOrigin().x();
+        pose.position.y = fp.getOrigin().y();
+        pose.position.z = fp.getOrigin().z();
+        firstPoses.push_back(pose);
     }
 
-    if (!ok) return false;
+    ros::Time begin = ros::Time::now();
+    robot_state::RobotState start(monitoredState());
+    std::vector<robot_state::RobotState> solutions;
+    std::vector<int> found;
+    solveIKParallel(firstPoses, start, solutions, found);
+
+    // Nearest the requested target first (to the mm); targets equally far
+    // away, like those on one ring, by how far the arm has to move
+    const robot_state::JointModelGroup* jmg = start.getJointModelGroup(group.getName());
+    std::vector<std::pair<std::pair<double, double>, int> > ranked;
+    for (int i = 0; i < found.size(); i++) {
+        if (!found[i]) continue;
+        double d = targets[i].getOrigin().distance(targets[0].getOrigin());
+        ranked.push_back(std::make_pair(std::make_pair(floor(d*1000)/1000,
+                                                       start.distance(solutions[i], jmg)), i));
+    }
+    std::sort(ranked.begin(), ranked.end());
+
+    std::vector<robot_state::RobotState> goals;
+    std::vector<int> goalTargets;
+    for (int i = 0; i < ranked.size(); i++) {
+        goals.push_back(solutions[ranked[i].second]);
+        goalTargets.push_back(ranked[i].second);
+    }
+    ROS_INFO("%i of %i put down targets have valid IK",
+             (int)goals.size(), (int)targets.size());
+
+    moveit_msgs::MotionPlanResponse planResponse;
+    int chosen = planToJointGoals(goals, true, planResponse);
+
+    currentPlan = moveit::planning_interface::MoveGroupInterface::Plan();
+    if (chosen == -1) {
+        writeQuery(targets.at(0)*prevObjRotation*usedGrasp.first, currentPlan);
+        return false;
+    }
+
+    int targetIndex = goalTargets[chosen];
+    tf2::Transform firstPose = targets.at(targetIndex)*prevObjRotation*usedGrasp.first;
+    ROS_INFO("Putting down at target %i", targetIndex);
+
+    currentPlan.trajectory_ = planResponse.trajectory;
+    currentPlan.start_state_ = planResponse.trajectory_start;
+    currentPlan.planning_time_ = (ros::Time::now() - begin).toSec();
+    finishTrajectory(currentPlan.trajectory_);
+    writeQuery(firstPose, currentPlan);
+    setCurrentGoalTo(firstPose);
 
     if (!executeCurrentPlan()) return false;
-    ros::Duration(1.0).sleep();
+    std::string held = getHeld();
+    waitForSettled(held, 1.0);
 
     tf2::Transform secondPose = targets.at(targetIndex)*prevObjRotation*usedGrasp.second;
     setCurrentGoalTo(secondPose);
     if (!planStraightLineMotion(secondPose)) return false;
     if (!executeCurrentPlan()) return false;
 
-    ros::Duration(0.5).sleep();
+    waitForSettled(held, 0.5);
     openGripper();
-    ros::Duration(0.5).sleep();
+    waitForSettled(held, 0.5);
 
     detachHeldObject();
     setCurrentGoalTo(firstPose);
     if (!planStraightLineMotion(firstPose)) return false;
     if (!executeCurrentPlan()) return false;
 
-    ros::Duration(0.5).sleep();
+    waitForSettled(held, 0.5);
     closeGripper();
-    ros::Duration(0.5).sleep();
+    waitForSettled(held, 0.5);
 
     if (!homeArm()) return false;
 
     return true;
 }
 
-bool ArmController::pointTo(tf2::Transform objXform, float objHeight) {
+bool ArmController::pointTo(tf2::Transform objXform, float objHeight,
+                            std::string objName) {
     tf2::Quaternion downRot;
     downRot.setRPY(0, M_PI/2, 0);
     tf2::Transform pointXform = tf2::Transform(downRot,
@@ -617,7 +987,7 @@ bool ArmController::pointTo(tf2::Transform objXform, float objHeight) {
     if (!planToXform(firstPose, numRetries)) return false;
     if (!executeCurrentPlan()) return false;
 
-    ros::Duration(1.0).sleep();
+    waitForSettled(objName, 1.0);
 
     if (!homeArm()) return false;
 
@@ -661,13 +1031,9 @@ bool ArmController::checkIKPose(tf2::Transform eeXform) {
       ROS_INFO("No IK solution!");
       return false;
     } else {
-      psm->requestPlanningSceneState();
-      planning_scene_monitor::LockedPlanningSceneRO ps(psm);
-      robot_state::RobotState rs(*group.getCurrentState(0.1));
-      //collision_detection::CollisionEnvConstPtr cr = ps->getCollisionEnvUnpadded();
-      collision_detection::AllowedCollisionMatrix acm;
-      acm.clear();
-      acm.setDefaultEntry("ground", true);
+      robot_state::RobotState rs(monitoredState());
+      boost::shared_lock<boost::shared_mutex> local(localMutex);
+      const collision_detection::AllowedCollisionMatrix& acm = localACM;
 
       std::vector<std::string> namesCopy = rs.getJointModelGroup("arm")->getJointModelNames();
       for (std::vector<std::string>::iterator i = namesCopy.begin();
@@ -680,8 +1046,8 @@ bool ArmController::checkIKPose(tf2::Transform eeXform) {
       req.group_name = "arm";
       req.verbose = true;
       collision_detection::CollisionResult res;
-      ps->getCollisionEnv()->checkRobotCollision(req, res,
-                                                 rs, acm);
+      localScene->getCollisionEnv()->checkRobotCollision(req, res,
+                                                         rs, acm);
 
       if (res.collision) {
         ROS_INFO("IK solution in collision!");
@@ -713,13 +1079,30 @@ bool ArmController::homeArm() {
         group.setStartStateToCurrentState();
     }
 
-    if (!group.plan(homePlan)) ok = false;
+    bool direct = false;
+    if (directPaths) {
+        directQueries++;
+        robot_state::RobotState start(monitoredState());
+        robot_state::RobotState goal(start);
+        goal.setJointGroupPositions(group.getName(), joints);
+        goal.update();
+        if (planDirectPath(start, goal, true)) {
+            directHits++;
+            ROS_INFO("Direct path home (%i of %i direct path queries hit)",
+                     directHits, directQueries);
+            homePlan = currentPlan;
+            direct = true;
+        }
+    }
+
+    if (!direct && !group.plan(homePlan)) ok = false;
 
     // To stop it thinking it's successful if null plan
     if (totalJointLength(homePlan.trajectory_) < 0.0001 ) {
         homePlan = moveit::planning_interface::MoveGroupInterface::Plan();
         ok = false;
     }
+    if (ok) finishTrajectory(homePlan.trajectory_);
     writeHomeQuery(homePlan);
     if (!ok) return false;
 
@@ -742,6 +1125,8 @@ bool ArmController::planToXform(tf2::Transform t, int n) {
     target.position.y = t.getOrigin().y();
     target.position.z = t.getOrigin().z();
 
+    if (directPaths && planDirectToXform(t, target)) return true;
+
     if (plannerName == STOMP) {
       group.setJointValueTarget(target);
     } else {
@@ -759,22 +1144,237 @@ bool ArmController::planToXform(tf2::Transform t, int n) {
     return true;
 }
 
+bool ArmController::planDirectToXform(tf2::Transform t, geometry_msgs::Pose target) {
+    directQueries++;
+
+    robot_state::RobotState start(monitoredState());
+    std::vector<geometry_msgs::Pose> poses(1, target);
+    std::vector<robot_state::RobotState> solutions;
+    std::vector<int> found;
+    solveIKParallel(poses, start, solutions, found);
+    if (!found[0] || !planDirectPath(start, solutions[0], false)) return false;
+
+    directHits++;
+    ROS_INFO("Direct path to target (%i of %i direct path queries hit)",
+             directHits, directQueries);
+    setCurrentGoalTo(t);
+    finishTrajectory(currentPlan.trajectory_);
+    writeQuery(t, currentPlan, "Direct");
+    return true;
+}
+
+// Tries a straight joint space line to goal, then a straight end effector
+// line to its gripper pose, both checked against the local scene. With
+// matchJoints the end effector line must also end in the goal joint state.
+// Sets currentPlan on success.
+bool ArmController::planDirectPath(robot_state::RobotState& start,
+                                   robot_state::RobotState& goal,
+                                   bool matchJoints) {
+    ros::Time begin = ros::Time::now();
+    const robot_state::JointModelGroup* jmg =
+        start.getJointModelGroup(group.getName());
+    std::string ee = group.getEndEffectorLink();
+    robot_trajectory::RobotTrajectory rt(group.getRobotModel(), group.getName());
+
+    bool ok = true;
+    {
+        boost::shared_lock<boost::shared_mutex> local(localMutex);
+        const planning_scene::PlanningSceneConstPtr scene = localScene;
+
+        // Joint distance bounds the motion of every joint, so this checks
+        // at least every 0.02 rad
+        int steps = std::max(1, (int)ceil(start.distance(goal, jmg) / 0.02));
+        robot_state::RobotState rs(start);
+        for (int i = 0; i <= steps && ok; i++) {
+            start.interpolate(goal, (double)i / steps, rs, jmg);
+            ok = stateClear(scene.get(), rs);
+            rt.addSuffixWayPoint(rs, 0.0);
+        }
+
+        if (!ok) {
+            rt.clear();
+            robot_state::RobotState cs(start);
+            std::vector<robot_state::RobotStatePtr> path;
+            moveit::core::GroupStateValidityCallbackFn valid =
+                boost::bind(&ArmController::ikStateValid, this, scene.get(), _1, _2, _3);
+            Eigen::Isometry3d target(goal.getGlobalLinkTransform(ee).matrix());
+            double frac = cs.computeCartesianPath(jmg, path, cs.getLinkModel(ee),
+                                                  target, true, 0.01, 1.5, valid);
+            ok = (frac > 0.999);
+            if (ok && matchJoints) ok = (cs.distance(goal, jmg) < 0.01);
+            for (int i = 0; ok && i < path.size(); i++) {
+                rt.addSuffixWayPoint(*path[i], 0.0);
+            }
+        }
+    }
+    if (!ok) return false;
+
+    trajectory_processing::IterativeParabolicTimeParameterization iptp;
+    iptp.computeTimeStamps(rt, velocityScaling);
+
+    currentPlan = moveit::planning_interface::MoveGroupInterface::Plan();
+    rt.getRobotTrajectoryMsg(currentPlan.trajectory_);
+    moveit::core::robotStateToRobotStateMsg(start, currentPlan.start_state_);
+    currentPlan.planning_time_ = (ros::Time::now() - begin).toSec();
+    return true;
+}
+
 bool ArmController::planToXformInner(tf2::Transform t) {
   setCurrentGoalTo(t);
 
   moveit::planning_interface::MoveGroupInterface::Plan mp;
-  moveit::planning_interface::MoveItErrorCode ok = group.plan(mp);
+  std::string alg = "";
+  bool ok;
+  if (dualPlanning) {
+    ok = planDual(t, mp, alg);
+  } else {
+    ok = (bool)group.plan(mp);
+  }
 
   // To stop it thinking it's successful if null plan
   if (totalJointLength(mp.trajectory_) < 0.0001 ) {
     mp = moveit::planning_interface::MoveGroupInterface::Plan();
     ok = false;
   }
+  if (ok) finishTrajectory(mp.trajectory_);
 
-  writeQuery(t, mp);
+  writeQuery(t, mp, alg);
 
   currentPlan = mp;
-  return (bool)ok;
+  return ok;
+}
+
+void ArmController::setDualPlanning(bool on, double grace, double minClearance) {
+    dualGrace = grace;
+    dualMinClearance = minClearance;
+    if (on && !paddedPipeline) {
+        // Separate planner instances so both can run at once
+        ros::NodeHandle mg("move_group");
+        paddedPipeline = std::make_shared<planning_pipeline::PlanningPipeline>(
+            psm->getRobotModel(), mg, "planning_plugin", "request_adapters");
+        unpaddedPipeline = std::make_shared<planning_pipeline::PlanningPipeline>(
+            psm->getRobotModel(), mg, "planning_plugin", "request_adapters");
+
+        boost::unique_lock<boost::shared_mutex> lock(localMutex);
+        // Same detector as the padded checks, so the two are comparable
+        unpaddedScene = std::make_shared<planning_scene::PlanningScene>(psm->getRobotModel());
+        unpaddedScene->allocateCollisionDetector(
+            collisionAllocator(localScene->getActiveCollisionDetectorName()));
+        unpaddedScene->getCollisionEnvNonConst()->setLinkPadding(localScene->getCollisionEnv()->getLinkPadding());
+        unpaddedScene->getCollisionEnvNonConst()->setLinkScale(localScene->getCollisionEnv()->getLinkScale());
+        unpaddedScene->getAllowedCollisionMatrixNonConst() = localScene->getAllowedCollisionMatrix();
+        updateDistanceScenes();
+    }
+    dualPlanning = on;
+    if (dualPlanning)
+        ROS_INFO("ArmController will plan against padded and unpadded objects, %f s grace",
+                 dualGrace);
+}
+
+// Runs the planner on snapshots of the padded and unpadded worlds at the
+// same time. A padded plan wins if it comes within dualGrace of a good
+// unpadded one; an unpadded plan is only good if it keeps dualMinClearance.
+bool ArmController::planDual(tf2::Transform t,
+                             moveit::planning_interface::MoveGroupInterface::Plan& mp,
+                             std::string& alg) {
+    ros::WallTime begin = ros::WallTime::now();
+
+    geometry_msgs::PoseStamped target;
+    target.header.frame_id = armPlanningFrame();
+    target.pose.position.x = t.getOrigin().x();
+    target.pose.position.y = t.getOrigin().y();
+    target.pose.position.z = t.getOrigin().z();
+    target.pose.orientation = tf2::toMsg(t.getRotation());
+
+    planning_interface::MotionPlanRequest req = basePlanRequest().motion_plan_request;
+    req.goal_constraints.push_back(
+        kinematic_constraints::constructGoalConstraints(group.getEndEffectorLink(), target,
+                                                        group.getGoalPositionTolerance(),
+                                                        group.getGoalOrientationTolerance()));
+
+    robot_state::RobotState rs(monitoredState());
+    planning_scene::PlanningScenePtr scenes[2];
+    planning_scene::PlanningScenePtr clearScene;
+    collision_detection::AllowedCollisionMatrix clearACM;
+    {
+        boost::shared_lock<boost::shared_mutex> local(localMutex);
+        clearACM = localACM;
+        scenes[0] = localScene->diff();
+        scenes[1] = unpaddedScene->diff();
+        clearScene = (unpaddedDistanceScene ? unpaddedDistanceScene->diff() : scenes[1]);
+    }
+    scenes[0]->setCurrentState(rs);
+    scenes[1]->setCurrentState(rs);
+    planning_pipeline::PlanningPipelinePtr pipelines[2] = {paddedPipeline, unpaddedPipeline};
+
+    planning_interface::MotionPlanResponse res[2];
+    bool done[2] = {false, false};
+    bool good[2] = {false, false};
+    boost::mutex m;
+    boost::condition_variable cond;
+
+    boost::thread_group planners;
+    for (int v = 0; v < 2; v++) {
+        planners.create_thread([&, v]() {
+            bool ok = pipelines[v]->generatePlan(scenes[v], req, res[v]) &&
+                res[v].error_code_.val == moveit_msgs::MoveItErrorCodes::SUCCESS;
+            if (ok && v == 1) {
+                moveit_msgs::RobotTrajectory traj;
+                res[v].trajectory_->getRobotTrajectoryMsg(traj);
+                std::vector<double> c = waypointClearances(clearScene.get(), clearACM, rs, traj);
+                ok = (c.size() > 0 && *std::min_element(c.begin(), c.end()) >= dualMinClearance);
+                if (!ok) ROS_INFO("Unpadded plan came too close to the scene");
+            }
+            boost::lock_guard<boost::mutex> guard(m);
+            done[v] = true;
+            good[v] = ok;
+            cond.notify_all();
+        });
+    }
+
+    int used = -1;
+    {
+        boost::unique_lock<boost::mutex> lock(m);
+        boost::system_time graceEnd;
+        bool inGrace = false;
+        while (used < 0) {
+            if (good[0]) {
+                used = 0;
+            } else if (done[0] && done[1]) {
+                used = (good[1] ? 1 : -2);
+            } else if (good[1]) {
+                if (!inGrace) {
+                    graceEnd = boost::get_system_time() +
+                        boost::posix_time::milliseconds((int)(dualGrace*1000));
+                    inGrace = true;
+                }
+                if (!cond.timed_wait(lock, graceEnd)) used = 1;
+            } else {
+                cond.wait(lock);
+            }
+        }
+    }
+
+    // Don't leave the other planner running into the next query
+    for (int v = 0; v < 2; v++) {
+        if (v != used) pipelines[v]->terminate();
+    }
+    planners.join_all();
+    if (used < 0) {
+        ROS_INFO("Neither the padded nor the unpadded scene gave a plan");
+        return false;
+    }
+
+    moveit_msgs::MotionPlanResponse msg;
+    res[used].getMessage(msg);
+    mp = moveit::planning_interface::MoveGroupInterface::Plan();
+    mp.trajectory_ = msg.trajectory;
+    mp.start_state_ = msg.trajectory_start;
+    mp.planning_time_ = (ros::WallTime::now() - begin).toSec();
+    alg = paToString(plannerName) + (used == 0 ? " (Padded)" : " (Unpadded)");
+    ROS_INFO("Dual planning used the %s scene after %f s", (used == 0 ? "padded" : "unpadded"),
+             mp.planning_time_);
+    return true;
 }
 
 bool ArmController::planToRegionAsList(float xD, float yD, float zD,
@@ -784,22 +1384,17 @@ bool ArmController::planToRegionAsList(float xD, float yD, float zD,
     ofs << std::endl << "BEGIN LIST REG" << std::endl;
     ofs.close();
 
+    bool ok = false;
     for (int i = 0; i < numTrials; i++) {
-        planToRegion(xD, yD, zD, p);
+        if (planToRegion(xD, yD, zD, p)) {
+            ok = true;
+        }
     }
-
-    return true;
+    return ok;
 }
 
-bool ArmController::planToRegion(float xD, float yD, float zD, geometry_msgs::Pose p) {
+moveit_msgs::GetMotionPlan::Request ArmController::basePlanRequest() {
     moveit_msgs::GetMotionPlan::Request planRequest;
-    moveit_msgs::GetMotionPlan::Response planResponse;
-    if (plannerName == STOMP) {
-        group.setStartState(*group.getCurrentState());
-    } else {
-        group.setStartStateToCurrentState();
-    }
-
     planRequest.motion_plan_request.group_name = group.getName();
     planRequest.motion_plan_request.num_planning_attempts = 1;
     planRequest.motion_plan_request.allowed_planning_time = planningTime;
@@ -815,67 +1410,285 @@ bool ArmController::planToRegion(float xD, float yD, float zD, geometry_msgs::Po
     } else if (plannerName == TRRTCLEAR) {
         planRequest.motion_plan_request.planner_id = "TRRTkConfigClearance";
     }
-    planRequest.motion_plan_request.goal_constraints.clear();
-
-    moveit_msgs::Constraints cm;
-    cm.name = "goalregion";
-    cm.joint_constraints.clear();
-    cm.position_constraints.clear();
-    cm.orientation_constraints.clear();
-    cm.visibility_constraints.clear();
-
-    geometry_msgs::PoseStamped ee_pose;
-    ee_pose.pose.position = p.position;
-    ee_pose.pose.position.z += 0.05;
-    ee_pose.pose.orientation = p.orientation;
-    ee_pose.header.frame_id = group.getPlanningFrame();
-
-    std::vector<double> position_t;
-    position_t.resize(3);
-    position_t[0] = xD;
-    position_t[1] = yD;
-    position_t[2] = zD;
-    std::vector<double> orientation_t;
-    orientation_t.resize(3);
-    for (int i = 0;  i < 3; i++) orientation_t[i] = M_PI;
-    cm = kinematic_constraints::constructGoalConstraints("gripper_link",
-                                                         ee_pose,
-                                                         position_t,
-                                                         orientation_t);
-
-    tf2::Transform regGoal;
-    regGoal.setOrigin(tf2::Vector3(p.position.x, p.position.y, p.position.z));
-    regGoal.setRotation(tf2::Quaternion::getIdentity());
-    setCurrentGoalTo(regGoal);
 
     if (plannerName == STOMP) {
       robot_state::RobotState ss(*group.getCurrentState());
       moveit::core::robotStateToRobotStateMsg(ss,
                                               planRequest.motion_plan_request.start_state,
                                               true);
-      ros::Duration(0.1).sleep();
     }
+    return planRequest;
+}
 
-    planRequest.motion_plan_request.goal_constraints.clear();
-    planRequest.motion_plan_request.goal_constraints.resize(1);
-    planRequest.motion_plan_request.goal_constraints[0] =
-      kinematic_constraints::mergeConstraints(cm,
-                                              planRequest.motion_plan_request.goal_constraints[0]);
-    ros::Duration(0.5).sleep();
+// Validity callback for IK: arm links must be clear of the world
+bool ArmController::ikStateValid(const planning_scene::PlanningScene* ps,
+                                 robot_state::RobotState* rs,
+                                 const robot_state::JointModelGroup* jmg,
+                                 const double* jointVals) {
+    rs->setJointGroupPositions(jmg, jointVals);
+    return stateClear(ps, *rs);
+}
 
-    if (!planRequestClient.call(planRequest, planResponse)) {
-        ROS_WARN("Requesting the current collision scene failed!!");
-        return false;
+bool ArmController::stateClear(const planning_scene::PlanningScene* ps,
+                               robot_state::RobotState& rs) {
+    rs.updateCollisionBodyTransforms();
+
+    collision_detection::CollisionRequest req;
+    req.group_name = "arm";
+    collision_detection::CollisionResult res;
+    ps->getCollisionEnv()->checkSelfCollision(req, res, rs, localACM);
+    if (res.collision) return false;
+    ps->getCollisionEnv()->checkRobotCollision(req, res, rs, localACM);
+    return !res.collision;
+}
+
+// Results of one planToJointGoals call. Held by shared pointer so a
+// request still running after the caller has picked a plan is safe.
+struct ArmController::PlanBatch {
+    boost::mutex mtx;
+    boost::condition_variable cv;
+    std::vector<moveit_msgs::GetMotionPlan::Request> requests;
+    // 0 pending, 1 succeeded, -1 failed or skipped
+    std::vector<int> status;
+    std::vector<moveit_msgs::MotionPlanResponse> responses;
+    // Set once the caller has its answer; workers skip what is left
+    bool done;
+};
+
+ArmController::~ArmController() {
+    {
+        boost::lock_guard<boost::mutex> guard(planQueueMutex);
+        stopPlanWorkers = true;
+        planQueue.clear();
+    }
+    planQueueCond.notify_all();
+    planWorkers.join_all();
+}
+
+// Non-persistent service calls each open their own connection, so the
+// workers can share one client
+void ArmController::planWorkerLoop() {
+    while (true) {
+        std::shared_ptr<PlanBatch> batch;
+        int index;
+        {
+            boost::unique_lock<boost::mutex> lock(planQueueMutex);
+            while (planQueue.empty() && !stopPlanWorkers) planQueueCond.wait(lock);
+            if (stopPlanWorkers) return;
+            batch = planQueue.front().first;
+            index = planQueue.front().second;
+            planQueue.pop_front();
+        }
+
+        bool skip;
+        {
+            boost::lock_guard<boost::mutex> guard(batch->mtx);
+            skip = batch->done;
+        }
+        moveit_msgs::GetMotionPlan::Response res;
+        bool ok = (!skip &&
+                   planRequestClient.call(batch->requests[index], res) &&
+                   res.motion_plan_response.error_code.val ==
+                   moveit_msgs::MoveItErrorCodes::SUCCESS);
+
+        boost::lock_guard<boost::mutex> guard(batch->mtx);
+        batch->status[index] = (ok ? 1 : -1);
+        if (ok) batch->responses[index] = res.motion_plan_response;
+        batch->cv.notify_all();
+    }
+}
+
+int ArmController::planToJointGoals(std::vector<robot_state::RobotState>& goals,
+                                    bool inOrder,
+                                    moveit_msgs::MotionPlanResponse& result) {
+    if (goals.size() == 0) return -1;
+
+    std::shared_ptr<PlanBatch> batch = std::make_shared<PlanBatch>();
+    batch->status.resize(goals.size(), 0);
+    batch->responses.resize(goals.size());
+    batch->done = false;
+
+    const robot_state::JointModelGroup* jmg =
+        group.getRobotModel()->getJointModelGroup(group.getName());
+    moveit_msgs::GetMotionPlan::Request base = basePlanRequest();
+    for (int i = 0; i < goals.size(); i++) {
+        batch->requests.push_back(base);
+        batch->requests[i].motion_plan_request.goal_constraints.push_back(
+            kinematic_constraints::constructGoalConstraints(goals[i], jmg));
+    }
+    {
+        boost::lock_guard<boost::mutex> guard(planQueueMutex);
+        for (int i = 0; i < goals.size(); i++) {
+            planQueue.push_back(std::make_pair(batch, i));
+        }
+    }
+    planQueueCond.notify_all();
+
+    // Take any success, or with inOrder the first success once every
+    // goal ahead of it has failed
+    int chosen = -1;
+    {
+        boost::unique_lock<boost::mutex> lock(batch->mtx);
+        while (true) {
+            bool pending = false;
+            for (int i = 0; i < goals.size(); i++) {
+                if (batch->status[i] == 1) {
+                    result = batch->responses[i];
+                    chosen = i;
+                    break;
+                }
+                if (batch->status[i] == 0) {
+                    pending = true;
+                    if (inOrder) break;
+                }
+            }
+            if (chosen != -1 || !pending) break;
+            batch->cv.wait(lock);
+        }
+        batch->done = true;
+    }
+
+    // Drop the requests no worker has started. Those already running
+    // finish within the planning time and are ignored.
+    boost::lock_guard<boost::mutex> guard(planQueueMutex);
+    for (std::deque<std::pair<std::shared_ptr<PlanBatch>, int> >::iterator i = planQueue.begin();
+         i != planQueue.end(); ) {
+        if (i->first == batch) {
+            i = planQueue.erase(i);
+        } else {
+            i++;
+        }
+    }
+    return chosen;
+}
+
+// Solves collision-free IK for every pose on all cores; found[i] says
+// whether solutions[i] holds one. Kinematics solvers are not thread-safe,
+// so each worker solves with its own model's solver and checks collisions
+// on its own copy of start.
+void ArmController::solveIKParallel(std::vector<geometry_msgs::Pose>& poses,
+                                    robot_state::RobotState& start,
+                                    std::vector<robot_state::RobotState>& solutions,
+                                    std::vector<int>& found) {
+    const robot_state::JointModelGroup* jmg =
+        start.getJointModelGroup(group.getName());
+    std::string ee = group.getEndEffectorLink();
+
+    solutions.assign(poses.size(), start);
+    found.assign(poses.size(), 0);
+
+    boost::shared_lock<boost::shared_mutex> local(localMutex);
+    const planning_scene::PlanningSceneConstPtr scene = localScene;
+
+    std::atomic<int> next(0);
+    int numThreads = std::min((int)poses.size(), (int)ikModels.size());
+    boost::thread_group workers;
+    for (int t = 0; t < numThreads; t++) {
+        workers.create_thread([&, t]() {
+            robot_state::RobotState ws(ikModels[t]);
+            const robot_state::JointModelGroup* wjmg =
+                ws.getJointModelGroup(group.getName());
+            robot_state::RobotState check(start);
+            moveit::core::GroupStateValidityCallbackFn valid =
+                [&](robot_state::RobotState* rs, const robot_state::JointModelGroup* g,
+                    const double* jointVals) {
+                    rs->setJointGroupPositions(g, jointVals);
+                    check.setJointGroupPositions(jmg, jointVals);
+                    return stateClear(scene.get(), check);
+                };
+
+            for (int i = next++; i < poses.size(); i = next++) {
+                ws.setVariablePositions(start.getVariablePositions());
+                ws.update();
+                if (ws.setFromIK(wjmg, poses[i], ee, 0.05, valid)) {
+                    solutions[i].setVariablePositions(ws.getVariablePositions());
+                    solutions[i].update();
+                    found[i] = 1;
+                }
+            }
+        });
+    }
+    workers.join_all();
+}
+
+void ArmController::setRegionSampling(int samples, int topK) {
+    if (samples < 1 || topK < 1) {
+        ROS_WARN("Region sampling needs at least one sample and one plan!");
+        return;
+    }
+    regionSamples = samples;
+    regionTopK = topK;
+}
+
+// Samples end effector poses in the tolerance box, keeps those with
+// collision-free IK and plans to the ones closest to the start at once
+bool ArmController::planToRegion(float xD, float yD, float zD, geometry_msgs::Pose p) {
+    ros::Time begin = ros::Time::now();
+
+    tf2::Transform regGoal;
+    regGoal.setOrigin(tf2::Vector3(p.position.x, p.position.y, p.position.z));
+    regGoal.setRotation(tf2::Quaternion::getIdentity());
+    setCurrentGoalTo(regGoal);
+
+    // The box is xD by yD by zD centered on p, so offsets are at most half
+    // of each. Any orientation satisfies the region, but half the samples
+    // point the gripper down since those are the most likely to be reachable
+    std::mt19937 gen(std::random_device{}());
+    std::uniform_real_distribution<double> unit(-1.0, 1.0);
+    std::normal_distribution<double> gauss(0.0, 1.0);
+    std::vector<geometry_msgs::Pose> samples;
+    for (int i = 0; i < regionSamples; i++) {
+        geometry_msgs::Pose s;
+        s.position.x = p.position.x + 0.5*xD*unit(gen);
+        s.position.y = p.position.y + 0.5*yD*unit(gen);
+        s.position.z = p.position.z + 0.05 + 0.5*zD*unit(gen);
+
+        tf2::Quaternion q;
+        if (i % 2 == 0) {
+            q.setRPY(0, M_PI/2, M_PI*unit(gen));
+        } else {
+            q = tf2::Quaternion(gauss(gen), gauss(gen), gauss(gen), gauss(gen));
+            q.normalize();
+        }
+        s.orientation = tf2::toMsg(q);
+        samples.push_back(s);
     }
 
+    robot_state::RobotState start(monitoredState());
+    const robot_state::JointModelGroup* jmg =
+        start.getJointModelGroup(group.getName());
+
+    std::vector<robot_state::RobotState> solutions;
+    std::vector<int> found;
+    solveIKParallel(samples, start, solutions, found);
+
+    std::vector<std::pair<double, int> > ranked;
+    for (int i = 0; i < found.size(); i++) {
+        if (found[i]) ranked.push_back(std::make_pair(solutions[i].distance(start, jmg), i));
+    }
+    std::sort(ranked.begin(), ranked.end());
+
+    ROS_INFO("Region sampling: %i of %i poses have valid IK",
+             (int)ranked.size(), regionSamples);
+
+    std::vector<robot_state::RobotState> goals;
+    for (int i = 0; i < ranked.size() && i < regionTopK; i++) {
+        goals.push_back(solutions[ranked[i].second]);
+    }
+
+    moveit_msgs::MotionPlanResponse planResponse;
+    int chosen = planToJointGoals(goals, false, planResponse);
+
     currentPlan = moveit::planning_interface::MoveGroupInterface::Plan();
     tf2::Transform actualGoal;
 
     // success
-    if (planResponse.motion_plan_response.error_code.val == moveit_msgs::MoveItErrorCodes::SUCCESS) {
-        currentPlan.trajectory_ = planResponse.motion_plan_response.trajectory;
-        currentPlan.start_state_ = planResponse.motion_plan_response.trajectory_start;
-        currentPlan.planning_time_ = planResponse.motion_plan_response.planning_time;
+    if (chosen != -1) {
+        currentPlan.trajectory_ = planResponse.trajectory;
+        currentPlan.start_state_ = planResponse.trajectory_start;
+        // Sampling and IK are part of the cost of planning to a region
+        currentPlan.planning_time_ = (ros::Time::now() - begin).toSec();
+        finishTrajectory(currentPlan.trajectory_);
 
         robot_trajectory::RobotTrajectory rt(group.getRobotModel(), group.getName());
         robot_state::RobotState curStateCopy(*group.getCurrentState());
@@ -895,6 +1708,7 @@ bool ArmController::planToRegion(float xD, float yD, float zD, geometry_msgs::Po
 
     writeQuery(actualGoal, currentPlan);
     setCurrentGoalTo(actualGoal);
+    return (chosen != -1);
 }
 
 double ArmController::planStraightLineMotion(tf2::Transform target) {
@@ -915,12 +1729,160 @@ double ArmController::planStraightLineMotion(tf2::Transform target) {
                                              lineTraj,
                                              false);
 
+    if (frac > 0) finishTrajectory(lineTraj);
     currentPlan = moveit::planning_interface::MoveGroupInterface::Plan();
     currentPlan.trajectory_ = lineTraj;
 
     return frac;
 }
 
+double ArmController::speedForClearance(double clearance) {
+    if (clearance <= curveClearances.front()) return curveScales.front();
+    if (clearance >= curveClearances.back()) return curveScales.back();
+
+    int i = 1;
+    while (curveClearances[i] < clearance) i++;
+    double f = ((clearance - curveClearances[i-1]) /
+                (curveClearances[i] - curveClearances[i-1]));
+    return curveScales[i-1] + f*(curveScales[i] - curveScales[i-1]);
+}
+
+// Stretches each segment of a full-speed trajectory by the speed scale
+// allowed by the clearance at its two ends
+void ArmController::retimeForClearance(moveit_msgs::RobotTrajectory& traj) {
+    std::vector<trajectory_msgs::JointTrajectoryPoint>& pts =
+        traj.joint_trajectory.points;
+    if (traj.multi_dof_joint_trajectory.points.size() > 0 || pts.size() < 2) return;
+
+    std::vector<double> dists = waypointClearances(traj);
+
+    std::vector<double> segScale(pts.size(), 1.0);
+    for (int i = 1; i < pts.size(); i++) {
+        segScale[i] = speedForClearance(std::min(dists[i-1], dists[i]));
+    }
+
+    double origTime = execTime(traj);
+    ros::Duration prevOld = pts[0].time_from_start;
+    ros::Duration prevNew = pts[0].time_from_start;
+    for (int i = 1; i < pts.size(); i++) {
+        ros::Duration dt = pts[i].time_from_start - prevOld;
+        prevOld = pts[i].time_from_start;
+        pts[i].time_from_start = prevNew + ros::Duration(dt.toSec() / segScale[i]);
+        prevNew = pts[i].time_from_start;
+    }
+
+    // A waypoint can go no faster than the slower of its two segments
+    for (int i = 0; i < pts.size(); i++) {
+        double s = 1.0;
+        if (i > 0) s = std::min(s, segScale[i]);
+        if (i + 1 < pts.size()) s = std::min(s, segScale[i+1]);
+        for (int j = 0; j < pts[i].velocities.size(); j++) {
+            pts[i].velocities[j] *= s;
+        }
+        for (int j = 0; j < pts[i].accelerations.size(); j++) {
+            pts[i].accelerations[j] *= s*s;
+        }
+    }
+
+    ROS_INFO("Clearance retiming: %f s at full speed, %f s executed",
+             origTime, execTime(traj));
+}
+
+// Greedily drops waypoints while joint interpolation between the kept
+// ones stays within waypointTolerance of the original end effector path
+// and out of collision, then retimes what is left
+void ArmController::reduceWaypoints(moveit_msgs::RobotTrajectory& traj) {
+    std::vector<trajectory_msgs::JointTrajectoryPoint>& pts =
+        traj.joint_trajectory.points;
+    if (waypointTolerance <= 0 ||
+        traj.multi_dof_joint_trajectory.points.size() > 0 ||
+        pts.size() < 3) return;
+
+    int before = pts.size();
+    std::string ee = group.getEndEffectorLink();
+
+    robot_state::RobotState rs(monitoredState());
+    robot_state::RobotState ref(rs);
+    boost::shared_lock<boost::shared_mutex> local(localMutex);
+
+    std::vector<Eigen::Vector3d> eePath;
+    for (int i = 0; i < pts.size(); i++) {
+        rs.setVariablePositions(traj.joint_trajectory.joint_names,
+                                pts[i].positions);
+        rs.update(true);
+        eePath.push_back(rs.getGlobalLinkTransform(ee).translation());
+    }
+
+    std::vector<double> q(pts[0].positions.size());
+    std::vector<trajectory_msgs::JointTrajectoryPoint> kept;
+    kept.push_back(pts[0]);
+    int anchor = 0;
+    while (anchor < pts.size() - 1) {
+        int furthest = anchor + 1;
+        for (int j = anchor + 2; j < pts.size(); j++) {
+            double span = (pts[j].time_from_start - pts[anchor].time_from_start).toSec();
+            bool ok = true;
+            for (int k = anchor + 1; k < j && ok; k++) {
+                double f = (span > 0 ?
+                            (pts[k].time_from_start - pts[anchor].time_from_start).toSec() / span :
+                            (double)(k - anchor) / (j - anchor));
+                for (int d = 0; d < q.size(); d++) {
+                    q[d] = pts[anchor].positions[d] +
+                        f*(pts[j].positions[d] - pts[anchor].positions[d]);
+                }
+                rs.setVariablePositions(traj.joint_trajectory.joint_names, q);
+                rs.update(true);
+
+                if ((rs.getGlobalLinkTransform(ee).translation() - eePath[k]).norm() >
+                    waypointTolerance) {
+                    ok = false;
+                }
+            }
+
+            // The whole segment, not just the dropped waypoints, at least
+            // every 0.02 rad like planDirectPath
+            double maxDelta = 0;
+            for (int d = 0; d < q.size(); d++) {
+                maxDelta = std::max(maxDelta, fabs(pts[j].positions[d] - pts[anchor].positions[d]));
+            }
+            int steps = std::max(1, (int)ceil(maxDelta / 0.02));
+            for (int i = 1; i < steps && ok; i++) {
+                double f = (double)i / steps;
+                for (int d = 0; d < q.size(); d++) {
+                    q[d] = pts[anchor].positions[d] +
+                        f*(pts[j].positions[d] - pts[anchor].positions[d]);
+                }
+                rs.setVariablePositions(traj.joint_trajectory.joint_names, q);
+                rs.update(true);
+                ok = stateClear(localScene.get(), rs);
+            }
+            if (!ok) break;
+            furthest = j;
+        }
+        kept.push_back(pts[furthest]);
+        anchor = furthest;
+    }
+
+    // The kept points' old velocities and accelerations belong to the
+    // dense path, so time the reduced one from scratch
+    pts = kept;
+    robot_trajectory::RobotTrajectory rt(group.getRobotModel(), group.getName());
+    rt.setRobotTrajectoryMsg(ref, traj);
+    trajectory_processing::IterativeParabolicTimeParameterization iptp;
+    if (!iptp.computeTimeStamps(rt, velocityScaling)) {
+        ROS_WARN("Retiming the reduced trajectory failed!!");
+    }
+    rt.getRobotTrajectoryMsg(traj);
+    ROS_INFO("Waypoint reduction: %i -> %i waypoints", before, (int)pts.size());
+}
+
+// Runs before a plan is logged, so the log records the trajectory that
+// will be executed
+void ArmController::finishTrajectory(moveit_msgs::RobotTrajectory& traj) {
+    reduceWaypoints(traj);
+    if (adaptiveSpeed) retimeForClearance(traj);
+}
+
 bool ArmController::executeCurrentPlan() {
     if (!safetyCheck()) {
         return false;
@@ -935,11 +1897,14 @@ bool ArmController::executeCurrentPlan() {
 }
 
 void ArmController::writeQuery(tf2::Transform t,
-                               moveit::planning_interface::MoveGroupInterface::Plan p) {
+                               moveit::planning_interface::MoveGroupInterface::Plan p,
+                               std::string alg) {
+    if (alg == "") alg = paToString(plannerName);
+
     std::ofstream ofs;
     ofs.open(logFileName, std::ofstream::out | std::ofstream::app);
 
-    ofs << "AL " << paToString(plannerName);
+    ofs << "AL " << alg;
     ofs << " TO "
         << t.getOrigin().x() << " "
         << t.getOrigin().y() << " "
@@ -956,6 +1921,7 @@ void ArmController::writeQuery(tf2::Transform t,
     } else {
         ofs << "-1";
     }
+    ofs << " WV " << loggedSceneVersion();
 
     writeTrajectoryInfo(ofs, p.trajectory_, p.start_state_);
     ofs << std::endl;
@@ -964,10 +1930,11 @@ void ArmController::writeQuery(tf2::Transform t,
 
     if (isReplay) return;
 
+    boost::lock_guard<boost::mutex> bag(bagMutex);
     ros::Time sharedT = ros::Time::now();
 
     std_msgs::String pname;
-    pname.data = paToString(plannerName);
+    pname.data = alg;
     bagFile.write("planners", sharedT, pname);
 
     geometry_msgs::Transform xf = tf2::toMsg(t);
@@ -1000,6 +1967,7 @@ void ArmController::writeHomeQuery(moveit::planning_interface::MoveGroupInterfac
     } else {
         ofs << "-1";
     }
+    ofs << " WV " << loggedSceneVersion();
     writeTrajectoryInfo(ofs, p.trajectory_, p.start_state_);
     ofs << std::endl;
 
@@ -0,0 +1,192 @@
+#include <string>
+#include <vector>
+#include <cmath>
+
+#include <ros/ros.h>
+#include <rosbag/bag.h>
+#include <rosbag/view.h>
+#include <moveit/robot_model_loader/robot_model_loader.h>
+#include <moveit/planning_scene/planning_scene.h>
+
+#include "moveit_msgs/PlanningSceneWorld.h"
+#include "trajectory_msgs/JointTrajectory.h"
+
+#include "ArmController.h"
+
+// Replays the scenes and trajectories in a motion server bag against each
+// collision backend, timing the local checks and comparing clearances
+class CollisionBenchmark {
+public:
+    struct Backend {
+        std::string name;
+        planning_scene::PlanningScenePtr scene;
+        double collisionTime;
+        double distanceTime;
+        std::vector<double> clearances;
+        std::vector<bool> collisions;
+    };
+
+    CollisionBenchmark() : ready(false),
+                           loader("robot_description") {
+        std::string bagName;
+        if (!n.getParam("/rosie_collision_benchmark/filename", bagName)) {
+            ROS_WARN("CollisionBenchmark is missing a filename!");
+            return;
+        }
+        std::vector<std::string> names;
+        if (!n.getParam("/rosie_collision_benchmark/backends", names)) {
+            names.push_back("fcl");
+            names.push_back("bullet");
+        }
+
+        try {
+            bagFile.open(bagName, rosbag::bagmode::Read);
+        } catch (rosbag::BagException e) {
+            ROS_WARN("CollisionBenchmark error: %s", e.what());
+            return;
+        }
+
+        robot_model::RobotModelConstPtr model = loader.getModel();
+        if (!model) {
+            ROS_WARN("CollisionBenchmark could not load the robot model!");
+            return;
+        }
+
+        for (int i = 0; i < names.size(); i++) {
+            collision_detection::CollisionDetectorAllocatorPtr alloc =
+                ArmController::collisionAllocator(names[i]);
+            if (!alloc) {
+                ROS_WARN("Unknown collision backend %s", names[i].c_str());
+                continue;
+            }
+            Backend b;
+            b.name = names[i];
+            b.scene = std::make_shared<planning_scene::PlanningScene>(model);
+            b.scene->allocateCollisionDetector(alloc);
+            b.collisionTime = 0;
+            b.distanceTime = 0;
+            backends.push_back(b);
+        }
+
+        acm = backends.size() > 0 ? backends[0].scene->getAllowedCollisionMatrix() :
+            collision_detection::AllowedCollisionMatrix();
+        acm.setDefaultEntry("ground", true);
+        ready = (backends.size() > 0);
+    }
+
+    bool process() {
+        std::vector<std::string> topics;
+        topics.push_back(std::string("scenes"));
+        topics.push_back(std::string("trajectories"));
+        rosbag::View view(bagFile, rosbag::TopicQuery(topics));
+
+        int numScenes = 0;
+        int numTrajectories = 0;
+        for (rosbag::MessageInstance const m: view) {
+            // Scenes are recorded as the diffs sent to move_group
+            moveit_msgs::PlanningSceneWorld::ConstPtr s =
+                m.instantiate<moveit_msgs::PlanningSceneWorld>();
+            if (s != NULL) {
+                for (int i = 0; i < backends.size(); i++) {
+                    for (int j = 0; j < s->collision_objects.size(); j++) {
+                        backends[i].scene->processCollisionObjectMsg(s->collision_objects[j]);
+                    }
+                }
+                numScenes++;
+                continue;
+            }
+
+            trajectory_msgs::JointTrajectory::ConstPtr traj =
+                m.instantiate<trajectory_msgs::JointTrajectory>();
+            if (traj != NULL && numScenes > 0) {
+                for (int i = 0; i < backends.size(); i++) {
+                    checkTrajectory(backends[i], *traj);
+                }
+                numTrajectories++;
+            }
+        }
+
+        if (numTrajectories == 0) {
+            ROS_WARN("No trajectories with a scene found in the bag!");
+            return false;
+        }
+        report(numScenes, numTrajectories);
+        return true;
+    }
+
+    bool fileReady() {
+        return ready;
+    }
+
+private:
+    void checkTrajectory(Backend& b, const trajectory_msgs::JointTrajectory& traj) {
+        robot_state::RobotState rs(b.scene->getCurrentState());
+        for (int i = 0; i < traj.points.size(); i++) {
+            rs.setVariablePositions(traj.joint_names, traj.points[i].positions);
+            rs.updateCollisionBodyTransforms();
+
+            collision_detection::CollisionRequest req;
+            req.group_name = "arm";
+            collision_detection::CollisionResult res;
+            ros::WallTime begin = ros::WallTime::now();
+            b.scene->getCollisionEnv()->checkRobotCollision(req, res, rs, acm);
+            b.collisionTime += (ros::WallTime::now() - begin).toSec();
+            b.collisions.push_back(res.collision);
+
+            // Same query clearanceData makes
+            req.distance = true;
+            collision_detection::CollisionResult dres;
+            begin = ros::WallTime::now();
+            b.scene->getCollisionEnv()->checkRobotCollision(req, dres, rs, acm);
+            b.distanceTime += (ros::WallTime::now() - begin).toSec();
+            b.clearances.push_back(dres.distance < 0 ? 0 : dres.distance);
+        }
+    }
+
+    // Agreement is against the first backend listed
+    void report(int numScenes, int numTrajectories) {
+        int numStates = backends[0].clearances.size();
+        ROS_INFO("CollisionBenchmark: %i scene updates, %i trajectories, %i states",
+                 numScenes, numTrajectories, numStates);
+        for (int i = 0; i < backends.size(); i++) {
+            Backend& b = backends[i];
+            double maxDiff = 0;
+            double sumDiff = 0;
+            int verdicts = 0;
+            for (int j = 0; j < numStates; j++) {
+                double d = fabs(b.clearances[j] - backends[0].clearances[j]);
+                sumDiff += d;
+                if (d > maxDiff) maxDiff = d;
+                if (b.collisions[j] != backends[0].collisions[j]) verdicts++;
+            }
+            ROS_INFO("%s: collision %f us, distance %f us per state; clearance vs %s mean %f max %f m, %i collision disagreements",
+                     b.name.c_str(),
+                     b.collisionTime*1e6 / numStates,
+                     b.distanceTime*1e6 / numStates,
+                     backends[0].name.c_str(),
+                     sumDiff / numStates, maxDiff, verdicts);
+        }
+    }
+
+    ros::NodeHandle n;
+    rosbag::Bag bagFile;
+    robot_model_loader::RobotModelLoader loader;
+    std::vector<Backend> backends;
+    collision_detection::AllowedCollisionMatrix acm;
+
+    bool ready;
+};
+
+int main(int argc, char** argv)
+{
+    ros::init(argc, argv, "rosie_collision_benchmark");
+    CollisionBenchmark cb;
+
+    if (cb.fileReady() && cb.process()) {
+        ROS_INFO("CollisionBenchmark finished with the file successfully!");
+    } else {
+        ROS_WARN("CollisionBenchmark encountered an error!");
+    }
+
+    return 0;
+}
@@ -0,0 +1,206 @@
+#include "CompiledDatabase.h"
+
+#include <fstream>
+#include <cstring>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <ros/ros.h>
+
+bool CompiledDatabase::sourceStamp(const std::string& source, uint64_t& size, int64_t& mtime) {
+  struct stat st;
+  if (stat(source.c_str(), &st) != 0) return false;
+  size = st.st_size;
+  mtime = st.st_mtime;
+  return true;
+}
+
+// FNV-1a
+uint64_t CompiledDatabase::checksum(const char* bytes, std::size_t length) {
+  uint64_t h = 14695981039346656037ULL;
+  for (std::size_t i = 0; i < length; i++) {
+    h ^= (unsigned char)bytes[i];
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+std::size_t CompiledDatabase::payloadSize(const Header& h) {
+  return h.numObjects*sizeof(ObjectRecord) + h.numShapes*sizeof(ShapeRecord) +
+    h.numGrasps*sizeof(GraspRecord) + h.nameBytes;
+}
+
+// The checksum only says the file is the one that was written, so the
+// offsets are checked too before anything indexes with them
+bool CompiledDatabase::recordsInBounds() const {
+  const Header* h = header();
+  for (uint32_t i = 0; i < h->numObjects; i++) {
+    const ObjectRecord& o = objects()[i];
+    if ((uint64_t)o.nameOffset + o.nameLength > h->nameBytes) return false;
+    if ((uint64_t)o.firstShape + o.numShapes > h->numShapes) return false;
+    if (o.numGrasps != NO_GRASPS &&
+        (uint64_t)o.firstGrasp + o.numGrasps > h->numGrasps) return false;
+  }
+  for (uint32_t i = 0; i < h->numShapes; i++) {
+    if (shapes()[i].numDimensions > 3) return false;
+  }
+  return true;
+}
+
+tf2::Transform CompiledDatabase::toXform(const double* d) {
+  return tf2::Transform(tf2::Quaternion(d[3], d[4], d[5], d[6]),
+                        tf2::Vector3(d[0], d[1], d[2]));
+}
+
+void CompiledDatabase::fromXform(const tf2::Transform& xf, double* d) {
+  tf2::Quaternion q = xf.getRotation();
+  d[0] = xf.getOrigin().x();
+  d[1] = xf.getOrigin().y();
+  d[2] = xf.getOrigin().z();
+  d[3] = q.x();
+  d[4] = q.y();
+  d[5] = q.z();
+  d[6] = q.w();
+}
+
+bool CompiledDatabase::open(const std::string& file, const std::string& source) {
+  close();
+
+  int fd = ::open(file.c_str(), O_RDONLY);
+  if (fd < 0) {
+    ROS_INFO("No compiled object database at %s", file.c_str());
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size < sizeof(Header)) {
+    ::close(fd);
+    ROS_WARN("Compiled object database %s is truncated", file.c_str());
+    return false;
+  }
+  void* m = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  ::close(fd);
+  if (m == MAP_FAILED) {
+    ROS_WARN("Could not map compiled object database %s", file.c_str());
+    return false;
+  }
+  data = (const char*)m;
+  size = st.st_size;
+
+  const Header* h = header();
+  if (h->magic != MAGIC || h->version != FORMAT_VERSION) {
+    ROS_WARN("%s is not a version %u compiled object database", file.c_str(), FORMAT_VERSION);
+    close();
+    return false;
+  }
+  if (size != sizeof(Header) + payloadSize(*h)) {
+    ROS_WARN("Compiled object database %s has the wrong size", file.c_str());
+    close();
+    return false;
+  }
+
+  uint64_t srcSize = 0;
+  int64_t srcMtime = 0;
+  if (sourceStamp(source, srcSize, srcMtime) &&
+      (srcSize != h->sourceSize || srcMtime != h->sourceMtime)) {
+    ROS_WARN("Compiled object database %s is older than %s", file.c_str(), source.c_str());
+    close();
+    return false;
+  }
+  if (checksum(data + sizeof(Header), size - sizeof(Header)) != h->checksum) {
+    ROS_WARN("Compiled object database %s failed its checksum", file.c_str());
+    close();
+    return false;
+  }
+  if (!recordsInBounds()) {
+    ROS_WARN("Compiled object database %s has records that point outside it", file.c_str());
+    close();
+    return false;
+  }
+  return true;
+}
+
+void CompiledDatabase::close() {
+  if (data) munmap((void*)data, size);
+  data = NULL;
+  size = 0;
+}
+
+bool CompiledDatabase::write(const std::string& file, const std::string& source,
+                             const std::vector<Entry>& entries) {
+  Header h;
+  std::memset(&h, 0, sizeof(h));
+  h.magic = MAGIC;
+  h.version = FORMAT_VERSION;
+  if (!sourceStamp(source, h.sourceSize, h.sourceMtime)) {
+    ROS_WARN("Could not stat %s", source.c_str());
+    return false;
+  }
+
+  std::vector<ObjectRecord> objs;
+  std::vector<ShapeRecord> shps;
+  std::vector<GraspRecord> grs;
+  std::string nameTable;
+  for (int i = 0; i < entries.size(); i++) {
+    const Entry& e = entries[i];
+    ObjectRecord o;
+    std::memset(&o, 0, sizeof(o));
+    o.nameOffset = nameTable.size();
+    o.nameLength = e.name.size();
+    nameTable += e.name;
+    o.firstShape = shps.size();
+    o.numShapes = e.shapes.size();
+    o.firstGrasp = grs.size();
+    o.numGrasps = e.hasGrasps ? e.grasps.size() : NO_GRASPS;
+    o.footprintRadius = e.footprintRadius;
+    o.boundingRadius = e.boundingRadius;
+    objs.push_back(o);
+
+    for (int j = 0; j < e.shapes.size(); j++) {
+      ShapeRecord s;
+      std::memset(&s, 0, sizeof(s));
+      s.type = e.shapes[j].second.type;
+      s.numDimensions = std::min((int)e.shapes[j].second.dimensions.size(), 3);
+      for (int k = 0; k < s.numDimensions; k++) {
+        s.dimensions[k] = e.shapes[j].second.dimensions[k];
+      }
+      fromXform(e.shapes[j].first, s.xform);
+      shps.push_back(s);
+    }
+    for (int j = 0; j < e.grasps.size(); j++) {
+      GraspRecord g;
+      fromXform(e.grasps[j].first, g.first);
+      fromXform(e.grasps[j].second, g.second);
+      grs.push_back(g);
+    }
+  }
+  h.numObjects = objs.size();
+  h.numShapes = shps.size();
+  h.numGrasps = grs.size();
+  h.nameBytes = nameTable.size();
+
+  std::string payload;
+  payload.append((const char*)objs.data(), objs.size()*sizeof(ObjectRecord));
+  payload.append((const char*)shps.data(), shps.size()*sizeof(ShapeRecord));
+  payload.append((const char*)grs.data(), grs.size()*sizeof(GraspRecord));
+  payload.append(nameTable);
+  h.checksum = checksum(payload.data(), payload.size());
+
+  // Write beside the target and rename, so a running server never maps
+  // a half written file
+  std::string tmp = file + ".tmp";
+  std::ofstream ofs(tmp, std::ios::binary);
+  if (!ofs) {
+    ROS_WARN("Could not open %s", tmp.c_str());
+    return false;
+  }
+  ofs.write((const char*)&h, sizeof(h));
+  ofs.write(payload.data(), payload.size());
+  ofs.close();
+  if (!ofs || rename(tmp.c_str(), file.c_str()) != 0) {
+    ROS_WARN("Could not write %s", file.c_str());
+    return false;
+  }
+  return true;
+}
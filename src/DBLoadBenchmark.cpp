@@ -0,0 +1,117 @@
+#include <string>
+#include <vector>
+#include <fstream>
+
+#include <ros/ros.h>
+
+#include "rapidjson/document.h"
+
+#include "ObjectDatabase.h"
+#include "ObjectInfoLoader.h"
+#include "SyntheticScene.h"
+
+// Times loading a large synthetic object_info.json: the document parse
+// the old loader started with, the streaming loader at each thread count,
+// the whole ObjectDatabase, and the compiled binary
+class DBLoadBenchmark {
+public:
+    DBLoadBenchmark() : numModels(10000),
+                        numGrasps(24),
+                        reps(3),
+                        dbFile("synthetic_object_info.json") {
+        n.getParam("/rosie_db_load_benchmark/models", numModels);
+        n.getParam("/rosie_db_load_benchmark/grasps", numGrasps);
+        n.getParam("/rosie_db_load_benchmark/repetitions", reps);
+        n.getParam("/rosie_db_load_benchmark/database_file", dbFile);
+        if (!n.getParam("/rosie_db_load_benchmark/threads", threads)) {
+            int t[] = {1, 2, 4, 0};
+            threads.assign(t, t + 4);
+        }
+    }
+
+    bool run() {
+        SyntheticScene synth(numModels);
+        if (!synth.writeDatabase(dbFile, numGrasps)) return false;
+
+        ROS_INFO("DBLoadBenchmark: %i objects with %i grasps each, %i repetitions",
+                 numModels, numGrasps, reps);
+
+        ros::WallTime begin = ros::WallTime::now();
+        for (int i = 0; i < reps; i++) {
+            if (!parseDocument()) return false;
+        }
+        ROS_INFO("document parse only: %f ms", msSince(begin) / reps);
+
+        for (int t = 0; t < threads.size(); t++) {
+            ObjectInfoLoader loader(threads[t]);
+            std::vector<DatabaseEntryPtr> entries;
+            begin = ros::WallTime::now();
+            for (int i = 0; i < reps; i++) {
+                entries.clear();
+                if (!loader.load(dbFile, entries)) return false;
+            }
+            double ms = msSince(begin) / reps;
+            if (entries.size() != numModels) {
+                ROS_WARN("Streaming loader returned %i of %i objects", (int)entries.size(), numModels);
+                return false;
+            }
+            ROS_INFO("streaming loader, %i threads%s: %f ms",
+                     threads[t], (threads[t] == 0 ? " (one per core)" : ""), ms);
+        }
+
+        std::string compiledFile = dbFile + ".odb";
+        begin = ros::WallTime::now();
+        for (int i = 0; i < reps; i++) {
+            ObjectDatabase db(dbFile);
+            if (i == 0 && !db.compile(compiledFile)) return false;
+        }
+        ROS_INFO("ObjectDatabase from json: %f ms", msSince(begin) / reps);
+
+        begin = ros::WallTime::now();
+        for (int i = 0; i < reps; i++) {
+            ObjectDatabase db(dbFile, compiledFile);
+        }
+        ROS_INFO("ObjectDatabase from compiled: %f ms", msSince(begin) / reps);
+        return true;
+    }
+
+private:
+    bool parseDocument() {
+        std::ifstream jsonfile(dbFile);
+        std::string text((std::istreambuf_iterator<char>(jsonfile)),
+                         std::istreambuf_iterator<char>());
+        rapidjson::Document d;
+        d.Parse(text.c_str());
+        if (d.HasParseError() || !d.HasMember("objects")) {
+            ROS_WARN("DBLoadBenchmark could not parse %s", dbFile.c_str());
+            return false;
+        }
+        return true;
+    }
+
+    static double msSince(ros::WallTime begin) {
+        return (ros::WallTime::now() - begin).toSec()*1000.0;
+    }
+
+    ros::NodeHandle n;
+    int numModels;
+    int numGrasps;
+    int reps;
+    std::string dbFile;
+    std::vector<int> threads;
+};
+
+int main(int argc, char** argv)
+{
+    ros::init(argc, argv, "rosie_db_load_benchmark");
+    DBLoadBenchmark bench;
+
+    if (bench.run()) {
+        ROS_INFO("DBLoadBenchmark finished successfully!");
+    } else {
+        ROS_WARN("DBLoadBenchmark encountered an error!");
+        return 1;
+    }
+
+    return 0;
+}
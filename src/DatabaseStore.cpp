@@ -0,0 +1,75 @@
+#include "DatabaseStore.h"
+
+#include <sys/stat.h>
+
+DatabaseStore::DatabaseStore(std::string file, std::string compiled) : fileName(file),
+                                                                       compiledName(compiled),
+                                                                       loads(1),
+                                                                       reloading(false) {
+  Ptr first = std::make_shared<ObjectDatabase>(fileName, compiledName);
+  // Nothing to fall back on yet, so keep whatever was read
+  if (!first->ok()) ROS_WARN("Object database %s did not load cleanly", fileName.c_str());
+  std::atomic_store(&current, first);
+}
+
+DatabaseStore::~DatabaseStore() {
+  watchThread.interrupt();
+  if (watchThread.joinable()) watchThread.join();
+  if (reloadThread.joinable()) reloadThread.join();
+}
+
+bool DatabaseStore::reloadAsync() {
+  if (reloading.exchange(true)) {
+    ROS_INFO("Object database reload already running");
+    return false;
+  }
+  if (reloadThread.joinable()) reloadThread.join();
+  reloadThread = boost::thread(&DatabaseStore::reloadLoop, this);
+  return true;
+}
+
+void DatabaseStore::reloadLoop() {
+  ros::WallTime begin = ros::WallTime::now();
+  Ptr next = std::make_shared<ObjectDatabase>(fileName, compiledName);
+  if (!next->ok()) {
+    ROS_WARN("Object database %s failed to reload, keeping version %lu",
+             fileName.c_str(), (unsigned long)loads);
+    reloading = false;
+    return;
+  }
+  std::atomic_store(&current, next);
+  loads++;
+  ROS_INFO("Object database %s reloaded in %f s, now version %lu",
+           fileName.c_str(), (ros::WallTime::now() - begin).toSec(), (unsigned long)loads);
+  if (onSwap) onSwap(next);
+  reloading = false;
+}
+
+std::pair<long, long> DatabaseStore::fileStamps() {
+  struct stat st;
+  long json = (stat(fileName.c_str(), &st) == 0 ? st.st_mtime : 0);
+  long compiled = (compiledName != "" && stat(compiledName.c_str(), &st) == 0 ? st.st_mtime : 0);
+  return std::make_pair(json, compiled);
+}
+
+void DatabaseStore::watch(double period) {
+  if (period <= 0 || watchThread.joinable()) return;
+  watchThread = boost::thread(&DatabaseStore::watchLoop, this, period);
+}
+
+void DatabaseStore::watchLoop(double period) {
+  std::pair<long, long> seen = fileStamps();
+  try {
+    while (true) {
+      boost::this_thread::sleep(boost::posix_time::milliseconds((long)(period*1000)));
+      std::pair<long, long> now = fileStamps();
+      // A change that arrives during a reload is only marked seen once
+      // a reload that starts after it is accepted, so it is not lost
+      if (now != seen && reloadAsync()) {
+        ROS_INFO("%s changed, reloading the object database", fileName.c_str());
+        seen = now;
+      }
+    }
+  } catch (boost::thread_interrupted&) {
+  }
+}
@@ -11,6 +11,7 @@
 #include <math.h>
 
 #include <boost/thread.hpp>
+#include <boost/atomic.hpp>
 
 #include <ros/ros.h>
 #include <ros/callback_queue.h>
@@ -23,10 +24,14 @@
 #include "gazebo_msgs/ModelStates.h"
 #include "moveit_msgs/CollisionObject.h"
 #include "geometry_msgs/PoseArray.h"
+#include "diagnostic_msgs/DiagnosticStatus.h"
 
 #include "ObjectDatabase.h"
 #include "WorldObjects.h"
 #include "ArmController.h"
+#include "SceneBuilder.h"
+#include "ConflatingInput.h"
+#include "DatabaseStore.h"
 
 class MotionServer
 {
@@ -67,12 +72,21 @@ public:
   }
 
   MotionServer() : spinner(1, &inputQueue),
+                   jointSpinner(1, &jointQueue),
                    armSpinner(1, &armQueue),
                    tfBuf(),
                    tfListener(tfBuf),
                    lastCommandTime(0),
                    lastHandled(0),
+                   jointMessages(0),
                    state(WAIT),
+                   syncedVersion(0),
+                   regionVersion(0),
+                   syncedRegion(0),
+                   haveTaskRegion(false),
+                   objStore(databaseFile("object_database",
+                                         "/home/mamantov/catkin_ws/src/rosie_motion/config/object_info.json"),
+                            compiledFile("compiled_object_database")),
                    arm(n)
   {
     bool isSimRobot = false;
@@ -99,6 +113,46 @@ public:
       ROS_INFO("RosieMotionServer human checks on motion planning are on.");
     }
     arm.setHumanChecks(checkPlans);
+    bool dualPlanning = false;
+    std::string unpaddedFile;
+    if (n.getParam("/rosie_motion_server/dual_planning", dualPlanning) && dualPlanning) {
+      if (n.getParam("/rosie_motion_server/unpadded_object_database", unpaddedFile)) {
+        unpaddedStore = std::make_shared<DatabaseStore>(unpaddedFile,
+                                                        compiledFile("compiled_unpadded_object_database"));
+        double grace = 0.5;
+        double minClearance = 0.01;
+        n.getParam("/rosie_motion_server/dual_grace_period", grace);
+        n.getParam("/rosie_motion_server/dual_min_clearance", minClearance);
+        arm.setDualPlanning(true, grace, minClearance);
+      } else {
+        ROS_WARN("RosieMotionServer needs unpadded_object_database for dual planning; turning it off.");
+      }
+    }
+    useCurrentDatabases();
+    objStore.setOnSwap(boost::bind(&MotionServer::databaseSwapped, this, _1));
+    if (unpaddedStore) unpaddedStore->setOnSwap(boost::bind(&MotionServer::databaseSwapped, this, _1));
+
+    // Reload the databases when their files change; 0 only reloads on
+    // RELOAD commands
+    double watchPeriod = 0.0;
+    if (n.getParam("/rosie_motion_server/object_database_watch_period", watchPeriod) &&
+        watchPeriod > 0) {
+      objStore.watch(watchPeriod);
+      if (unpaddedStore) unpaddedStore->watch(watchPeriod);
+      ROS_INFO("RosieMotionServer will reload changed object databases every %f s", watchPeriod);
+    }
+
+    std::string acmFile;
+    if (n.getParam("/rosie_motion_server/acm_file", acmFile) && acmFile != "") {
+      arm.loadAllowedCollisions(acmFile);
+    } else {
+      ROS_INFO("RosieMotionServer found no acm_file param; using the SRDF's allowed collisions");
+    }
+
+    std::string collisionBackend;
+    if (n.getParam("/rosie_motion_server/collision_backend", collisionBackend)) {
+      arm.setCollisionBackend(collisionBackend);
+    }
 
     std::string planningLibName;
     if (!n.getParam("/rosie_motion_server/planning_library", planningLibName)) {
@@ -123,6 +177,81 @@ public:
       arm.setPlanningTime(15.0);
     }
 
+    bool adaptiveSpeed = false;
+    if (n.getParam("/rosie_motion_server/adaptive_speed", adaptiveSpeed) && adaptiveSpeed) {
+      std::vector<double> curveClear;
+      std::vector<double> curveScale;
+      if (n.getParam("/rosie_motion_server/speed_curve_clearances", curveClear) &&
+          n.getParam("/rosie_motion_server/speed_curve_scales", curveScale)) {
+        arm.setSpeedCurve(curveClear, curveScale);
+      } else {
+        ROS_INFO("RosieMotionServer found no speed curve params; using default curve");
+      }
+    }
+    arm.setAdaptiveSpeed(adaptiveSpeed);
+
+    double wpTol = 0.0;
+    if (n.getParam("/rosie_motion_server/waypoint_tolerance", wpTol)) {
+      ROS_INFO("RosieMotionServer will drop waypoints within %f m of the path", wpTol);
+    }
+    arm.setWaypointTolerance(wpTol);
+
+    int regionSamples = 64;
+    int regionTopK = 4;
+    n.getParam("/rosie_motion_server/region_samples", regionSamples);
+    n.getParam("/rosie_motion_server/region_top_k", regionTopK);
+    arm.setRegionSampling(regionSamples, regionTopK);
+
+    bool directPaths = true;
+    if (n.getParam("/rosie_motion_server/direct_path", directPaths) && !directPaths) {
+      ROS_INFO("RosieMotionServer will always use the sampling planner.");
+    }
+    arm.setDirectPaths(directPaths);
+
+    syncRate = 0.0;
+    if (n.getParam("/rosie_motion_server/scene_sync_rate", syncRate) && syncRate > 0) {
+      double syncTrans = 0.005;
+      double syncRot = 0.02;
+      n.getParam("/rosie_motion_server/scene_sync_translation", syncTrans);
+      n.getParam("/rosie_motion_server/scene_sync_rotation", syncRot);
+      arm.setSceneJitterThresholds(syncTrans, syncRot);
+      ROS_INFO("RosieMotionServer will sync the planning scene at up to %f Hz", syncRate);
+    }
+
+    // Gazebo publishes model states far faster than anything here needs
+    obsRate = 50.0;
+    n.getParam("/rosie_motion_server/model_states_rate", obsRate);
+
+    // The arm waits for objects it handles to stay within these (m, rad)
+    // for settle_window seconds, up to settle_timeout; 0 settle_timeout
+    // keeps its fixed sleeps
+    settleWindow = 0.25;
+    settleTrans = 0.005;
+    settleRot = 0.02;
+    double settleTimeout = 2.0;
+    n.getParam("/rosie_motion_server/settle_window", settleWindow);
+    n.getParam("/rosie_motion_server/settle_translation", settleTrans);
+    n.getParam("/rosie_motion_server/settle_rotation", settleRot);
+    n.getParam("/rosie_motion_server/settle_timeout", settleTimeout);
+    if (settleTimeout > 0) {
+      arm.setSettleCheck(boost::bind(&MotionServer::objectSettled, this, _1), settleTimeout);
+    }
+
+    // Roughly everything the Fetch arm can reach at any torso height
+    std::vector<double> wsCenter;
+    workspaceCenter = tf2::Vector3(0.15, 0.0, 0.9);
+    if (n.getParam("/rosie_motion_server/workspace_center", wsCenter) && wsCenter.size() == 3) {
+      workspaceCenter = tf2::Vector3(wsCenter[0], wsCenter[1], wsCenter[2]);
+    }
+    double workspaceRadius = 1.4;
+    n.getParam("/rosie_motion_server/workspace_radius", workspaceRadius);
+    sceneBuilder.setWorkspace(workspaceCenter, workspaceRadius);
+    taskPadding = 0.5;
+    n.getParam("/rosie_motion_server/task_region_padding", taskPadding);
+
+    dropRings = 2;
+    n.getParam("/rosie_motion_server/drop_rings", dropRings);
+
     list_on = false;
     if (!n.getParam("/rosie_motion_server/is_exp", list_on)) {
       ROS_INFO("RosieMotionServer is missing is_exp parameter! List handling off by default.");
@@ -138,16 +267,17 @@ public:
 
     ros::SubscribeOptions optionsObs =
       ros::SubscribeOptions::create<gazebo_msgs::ModelStates>("gazebo/model_states",
-                                                              10,
+                                                              1,
                                                               boost::bind(&MotionServer::obsCallback,
                                                                           this, _1),
                                                               ros::VoidPtr(), &inputQueue);
+    // Own queue, so gripper detection never waits behind model states
     ros::SubscribeOptions optionsJoint =
       ros::SubscribeOptions::create<sensor_msgs::JointState>("joint_states",
                                                               10,
                                                               boost::bind(&MotionServer::jointCallback,
                                                                           this, _1),
-                                                              ros::VoidPtr(), &inputQueue);
+                                                              ros::VoidPtr(), &jointQueue);
 
     obsSubscriber = n.subscribe(optionsObs);
     jointsSubscriber = n.subscribe(optionsJoint);
@@ -171,27 +301,166 @@ public:
 
     statusPublisher = n.advertise<rosie_msgs::RobotAction>("rosie_arm_status", 10);
     camXPublisher = n.advertise<geometry_msgs::TransformStamped>("rosie_camera", 10);
+    ingestPublisher = n.advertise<diagnostic_msgs::DiagnosticStatus>("rosie_ingest_stats", 1);
+    ingestTimer = n.createTimer(ros::Duration(1.0),
+                                &MotionServer::publishIngestStats, this);
     pubTimer = n.createTimer(ros::Duration(0.1),
                              &MotionServer::publishStatus, this);
 
     ROS_INFO("RosieMotionServer READY!");
   };
 
+  ~MotionServer()
+  {
+    if (syncThread.joinable()) syncThread.join();
+    if (obsThread.joinable()) obsThread.join();
+  }
+
   void start() {
+    obsThread = boost::thread(&MotionServer::modelStatesLoop, this);
     spinner.start();
     ROS_INFO("RosieMotionServer started INPUT SPINNER");
 
+    jointSpinner.start();
+    ROS_INFO("RosieMotionServer started JOINT SPINNER");
+
     armSpinner.start();
     ROS_INFO("RosieMotionServer started ARM SPINNER");
+
+    if (syncRate > 0) {
+      syncThread = boost::thread(&MotionServer::sceneSyncLoop, this);
+      ROS_INFO("RosieMotionServer started SCENE SYNC");
+    }
+  }
+
+  static std::string databaseFile(std::string param, std::string fallback)
+  {
+    std::string file;
+    if (!ros::param::get("/rosie_motion_server/" + param, file)) {
+      ROS_INFO("RosieMotionServer is missing %s param, using %s", param.c_str(), fallback.c_str());
+      return fallback;
+    }
+    return file;
+  }
+
+  // Optional, so "" when not set
+  static std::string compiledFile(std::string param)
+  {
+    std::string file;
+    ros::param::get("/rosie_motion_server/" + param, file);
+    return file;
+  }
+
+  void useCurrentDatabases()
+  {
+    arm.setObjectDatabase(objStore.get(),
+                          unpaddedStore ? unpaddedStore->get() : DatabaseStore::Ptr());
+  }
+
+  // Runs on the store's reload thread. The scene is resent so objects
+  // pick up any new shapes.
+  void databaseSwapped(DatabaseStore::Ptr db)
+  {
+    useCurrentDatabases();
+    boost::lock_guard<boost::mutex> guard(syncMutex);
+    regionVersion++;
+  }
+
+  // Sends a world snapshot to the planning scene, and the unpadded
+  // version of it to the arm's second scene when dual planning. Callers
+  // hold pushMutex. False if the planning scene was not updated.
+  bool pushCollisionScene(WorldSnapshot::ConstPtr snap)
+  {
+    DatabaseStore::Ptr db = objStore.get();
+    std::vector<moveit_msgs::CollisionObject> coList = getCollisionModels(snap, *db);
+    if (!arm.updateCollisionScene(coList, snap->version())) return false;
+    if (unpaddedStore) {
+      DatabaseStore::Ptr unpadded = unpaddedStore->get();
+      for (int i = 0; i < coList.size(); i++) {
+        if (coList[i].type.key == "" ||
+            !unpadded->dbHasModel(coList[i].type.key)) continue;
+        coList[i] = sceneBuilder.databaseObject(*snap, coList[i].id, *unpadded);
+      }
+      arm.updateUnpaddedScene(coList, snap->version());
+    }
+    return true;
+  }
+
+  // Pushes the world to the planning scene whenever it changes, at most
+  // syncRate times a second, except while a command has it pinned
+  void sceneSyncLoop()
+  {
+    ros::Rate r(syncRate);
+    while (ros::ok()) {
+      WorldSnapshot::ConstPtr snap = world.snapshot();
+      unsigned long v = snap->version();
+      unsigned long rv = 0;
+      bool behind = false;
+      {
+        boost::lock_guard<boost::mutex> guard(syncMutex);
+        rv = regionVersion;
+        behind = (syncedVersion < v || syncedRegion < rv);
+      }
+
+      if (behind) {
+        boost::lock_guard<boost::mutex> push(pushMutex);
+        if (!arm.scenePinned() && pushCollisionScene(snap)) {
+          boost::lock_guard<boost::mutex> guard(syncMutex);
+          syncedVersion = v;
+          syncedRegion = rv;
+        }
+      }
+      r.sleep();
+    }
   }
 
+  // Only hands the message to modelStatesLoop
   void obsCallback(const gazebo_msgs::ModelStates::ConstPtr& msg)
   {
-    world.update(msg);
+    obsInput.put(msg);
+  }
+
+  // Applies the newest model states, at most obsRate times a second
+  void modelStatesLoop()
+  {
+    ros::WallDuration period(obsRate > 0 ? 1.0/obsRate : 0.0);
+    while (ros::ok()) {
+      ros::WallTime begin = ros::WallTime::now();
+      ros::Time received;
+      gazebo_msgs::ModelStates::ConstPtr msg = obsInput.take(0.5, &received);
+      if (!msg) continue;
+      world.update(msg, received);
+      ros::WallDuration left = period - (ros::WallTime::now() - begin);
+      if (left > ros::WallDuration(0)) left.sleep();
+    }
+  }
+
+  void publishIngestStats(const ros::TimerEvent& e)
+  {
+    ConflatingInput<gazebo_msgs::ModelStates>::Counts c = obsInput.getCounts();
+    diagnostic_msgs::DiagnosticStatus msg;
+    msg.name = "rosie_motion_server ingest";
+    msg.level = msg.OK;
+    msg.values.push_back(keyValue("model_states_received", c.received));
+    msg.values.push_back(keyValue("model_states_processed", c.processed));
+    msg.values.push_back(keyValue("model_states_conflated", c.conflated));
+    msg.values.push_back(keyValue("joint_states_received", jointMessages));
+    ingestPublisher.publish(msg);
+  }
+
+  static diagnostic_msgs::KeyValue keyValue(std::string key, unsigned long value)
+  {
+    diagnostic_msgs::KeyValue kv;
+    kv.key = key;
+    std::stringstream ss;
+    ss << value;
+    kv.value = ss.str();
+    return kv;
   }
 
   void jointCallback(const sensor_msgs::JointState::ConstPtr& msg)
   {
+    jointMessages++;
     int pos1 = -1;
     int pos2 = -1;
     for (int i = 0; i < msg->name.size(); i++) {
@@ -245,12 +514,18 @@ public:
     else if (msg->action.find("SCENE")!=std::string::npos){
       ROS_INFO("Handling build scene command");
       state = SCENE;
-      arm.updateCollisionScene(getCollisionModels());
+      clearTaskRegion();
+      {
+        boost::lock_guard<boost::mutex> push(pushMutex);
+        pushCollisionScene(world.snapshot());
+      }
       state = WAIT;
     }
     else if (msg->action.find("RELOAD")!=std::string::npos){
       ROS_INFO("Handling reload object database command");
-      objData.reload();
+      // Commands keep using the old database until the new one is ready
+      objStore.reloadAsync();
+      if (unpaddedStore) unpaddedStore->reloadAsync();
     }
     else if (msg->action.find("CHECK")!=std::string::npos) {
       state = CHECK;
@@ -258,7 +533,7 @@ public:
       ROS_INFO("CHECK IK target %s", targetID.c_str());
       tf2::Transform xf;
       tf2::fromMsg(msg->dest, xf);
-      //arm.updateCollisionScene(getCollisionModels());
+      //pushCollisionScene(world.snapshot());
       if (arm.checkReachable(xf)) {
         state = WAIT;
       } else {
@@ -316,34 +591,56 @@ public:
     state = WAIT;
   }
 
+  // Settled over settleWindow up to the newest snapshot
+  bool objectSettled(const std::string& name)
+  {
+    return world.isStationary(name, world.snapshot()->stamp(), ros::Duration(settleWindow),
+                              settleTrans, settleRot);
+  }
+
+  // Where objID was when the arm's start state was measured, so a moving
+  // object is not paired with a robot state from another moment. Falls
+  // back to the snapshot when the history does not cover that time.
+  tf2::Transform alignedXformOf(const WorldSnapshot& snap, const std::string& objID)
+  {
+    tf2::Transform xf;
+    if (world.getXformAt(objID, arm.currentStateStamp(), xf)) return xf;
+    return snap.getXformOf(objID);
+  }
+
   // ID needs to be a substring of the object's model name
   void handleGrabCommand(std::string id)
   {
-    if (!world.isInScene(id)) {
+    WorldSnapshot::ConstPtr snap = world.snapshot();
+    DatabaseStore::Ptr db = objStore.get();
+    ROS_INFO("GRAB uses world version %lu", snap->version());
+    if (!snap->isInScene(id)) {
       ROS_INFO("%s is not in the scene", id.c_str());
       state = FAILURE;
       failureReason = "planning";
       return;
     }
-    tf2::Transform objXform = world.worldXformTimesTrans(world.nameInScene(id));
+    std::string objID = snap->nameInScene(id);
+    tf2::Transform objXform = snap->getWorldXform()*alignedXformOf(*snap, objID);
 
     // Find the grasp information for this object
     std::string databaseName = "";
-    if (objData.dbHasGrasps(id)) {
-      databaseName = objData.findDatabaseName(world.nameInScene(id));
+    if (db->dbHasGrasps(id)) {
+      databaseName = db->findDatabaseName(objID);
     }
 
-    if (databaseName == "" || objData.getNumGrasps(databaseName) < 1) {
+    if (databaseName == "" || db->getNumGrasps(databaseName) < 1) {
       ROS_INFO("We do not have a grasp list for %s", id.c_str());
       state = FAILURE;
       failureReason = "planning";
       return;
     }
 
-    arm.updateCollisionScene(getCollisionModels());
+    // The grasps are read in place; db keeps them alive through a reload
+    CommandScene scene(*this, snap, objXform.getOrigin());
     bool success = arm.pickUp(objXform,
-                              objData.getAllGrasps(databaseName),
-                              world.nameInScene(id));
+                              db->getAllGrasps(databaseName),
+                              objID);
 
     if (success) {
       state = WAIT;
@@ -356,14 +653,14 @@ public:
 
   void handleDropCommand(std::vector<float> target)
   {
-    if (target[2] == -1) target[2] = world.getTableH();
-    tf2::Transform targ;
-    targ.setIdentity();
-    targ.setOrigin(tf2::Vector3(target[0], target[1], target[2]));
-    std::vector<tf2::Transform> targList;
-    targList.push_back(targ);
-
-    arm.updateCollisionScene(getCollisionModels());
+    WorldSnapshot::ConstPtr snap = world.snapshot();
+    DatabaseStore::Ptr db = objStore.get();
+    ROS_INFO("DROP uses world version %lu", snap->version());
+    if (target[2] == -1) target[2] = snap->getTableH();
+    std::vector<tf2::Transform> targList =
+      dropCandidates(*snap, *db, tf2::Vector3(target[0], target[1], target[2]));
+
+    CommandScene scene(*this, snap, targList[0].getOrigin());
     bool success = arm.putDownHeldObj(targList);
 
     if (success) {
@@ -375,18 +672,89 @@ public:
     }
   }
 
+  // The requested target followed by rings of free table spots around it,
+  // nearest first
+  std::vector<tf2::Transform> dropCandidates(const WorldSnapshot& snap,
+                                             ObjectDatabase& db,
+                                             tf2::Vector3 request)
+  {
+    std::vector<tf2::Transform> cands;
+    tf2::Transform targ;
+    targ.setIdentity();
+    targ.setOrigin(request);
+    cands.push_back(targ);
+
+    float heldR = 0.f;
+    std::string held = arm.getHeld();
+    if (held != "NONE" && db.dbHasModel(held)) {
+      heldR = db.getFootprintRadius(db.findDatabaseName(held));
+    }
+
+    // Footprints of everything else on the table, and the table itself
+    bool haveTable = false;
+    tf2::Vector3 tableCenter;
+    std::vector<std::pair<tf2::Vector3, float> > occupied;
+    std::vector<std::string> objectIDs = snap.allObjectNames();
+    for (std::vector<std::string>::iterator i = objectIDs.begin();
+         i != objectIDs.end(); i++) {
+      if (i->find("ground_plane") != std::string::npos || *i == held) continue;
+      if (i->find("cafe_table") != std::string::npos) {
+        haveTable = true;
+        tableCenter = snap.worldXformTimesPos(*i);
+        continue;
+      }
+      if (!db.dbHasModel(*i)) continue;
+      occupied.push_back(std::make_pair(snap.worldXformTimesPos(*i),
+                                        db.getFootprintRadius(db.findDatabaseName(*i))));
+    }
+
+    float step = std::max(2*heldR, 0.04f);
+    for (int ring = 1; ring <= dropRings; ring++) {
+      float r = ring*step;
+      int num = std::max(6, (int)ceil(2*M_PI*r / step));
+      for (int k = 0; k < num; k++) {
+        float a = 2*M_PI*k / num;
+        tf2::Vector3 c(request.x() + r*cos(a), request.y() + r*sin(a), request.z());
+
+        // 0.95m square table top, see getCollisionModels
+        if (haveTable && (fabs(c.x() - tableCenter.x()) > 0.475 - heldR ||
+                          fabs(c.y() - tableCenter.y()) > 0.475 - heldR)) continue;
+
+        bool isClear = true;
+        for (int o = 0; o < occupied.size(); o++) {
+          float dx = c.x() - occupied[o].first.x();
+          float dy = c.y() - occupied[o].first.y();
+          if (sqrt(dx*dx + dy*dy) < heldR + occupied[o].second) {
+            isClear = false;
+            break;
+          }
+        }
+        if (!isClear) continue;
+
+        targ.setOrigin(c);
+        cands.push_back(targ);
+      }
+    }
+
+    ROS_INFO("Generated %i put down candidates", (int)cands.size());
+    return cands;
+  }
+
   void handlePointCommand(std::string id)
   {
-    if (!world.isInScene(id)) {
+    WorldSnapshot::ConstPtr snap = world.snapshot();
+    DatabaseStore::Ptr db = objStore.get();
+    ROS_INFO("POINT uses world version %lu", snap->version());
+    if (!snap->isInScene(id)) {
       ROS_INFO("Object ID %s is not being perceived", id.c_str());
       return;
     }
-    std::string objID = world.nameInScene(id);
+    std::string objID = snap->nameInScene(id);
 
     // Find the grasp information for this object
     std::string databaseName = "";
-    if (objData.dbHasModel(id)) {
-      databaseName = objData.findDatabaseName(objID);
+    if (db->dbHasModel(id)) {
+      databaseName = db->findDatabaseName(objID);
     }
     else {
       ROS_INFO("We do not have a collision model for %s", id.c_str());
@@ -396,9 +764,9 @@ public:
     }
 
     float shapeHeight = 0.f;
-    std::vector<SubShape> shapeVec =
-      objData.getCollisionModel(databaseName);
-    shape_msgs::SolidPrimitive cm = shapeVec[0].second;
+    const std::vector<SubShape>& shapeVec =
+      db->getCollisionModel(databaseName);
+    const shape_msgs::SolidPrimitive& cm = shapeVec[0].second;
     if (cm.type == cm.BOX) {
       shapeHeight = cm.dimensions[2];
     }
@@ -409,9 +777,9 @@ public:
       ROS_INFO("What kind of object are you?!");
     }
 
-    arm.updateCollisionScene(getCollisionModels());
-    bool success = arm.pointTo(world.getXformOf(objID),
-                               shapeHeight);
+    CommandScene scene(*this, snap, snap->worldXformTimesPos(objID));
+    bool success = arm.pointTo(alignedXformOf(*snap, objID),
+                               shapeHeight, objID);
 
     if (success) {
       state = WAIT;
@@ -441,108 +809,80 @@ public:
     camXPublisher.publish(camXform);
   }
 
-  std::vector<moveit_msgs::CollisionObject> getCollisionModels()
-  {
-    std::vector<moveit_msgs::CollisionObject> coList;
-
-    std::vector<std::string> objectIDs = world.allObjectNames();
-    for (std::vector<std::string>::iterator i = objectIDs.begin();
-         i != objectIDs.end(); i++) {
-      tf2::Vector3 fetchCentered = world.worldXformTimesPos(*i);
-      // Check if the fetch could actually hit this
-      float dist = tf2::tf2Distance(tf2::Vector3(0, 0, 0),
-                                    fetchCentered);
-
-      if (i->find("ground_plane") != std::string::npos) {
-        moveit_msgs::CollisionObject planeobj;
-        planeobj.id = "ground";
-
-        geometry_msgs::Pose planep;
-        planep.position.x = 0;
-        planep.position.y = 0;
-        planep.position.z = -0.025;
-
-        planep.orientation = tf2::toMsg(world.worldXformTimesRot(*i));
-
-        shape_msgs::SolidPrimitive primitive;
-        primitive.type = primitive.BOX;
-        primitive.dimensions.resize(3);
-        primitive.dimensions[0] = 2.0;
-        primitive.dimensions[1] = 2.0;
-        primitive.dimensions[2] = 0.05;
-
-        planeobj.primitives.push_back(primitive);
-        planeobj.primitive_poses.push_back(planep);
-        coList.push_back(planeobj);
-        continue;
+  // Holds the scene at a command's world snapshot, culled to its task
+  // region, for as long as it lives: background sync pauses, so planning,
+  // clearance checks and the query log all see that one version. Later
+  // HOME, CHECK and list requests get the whole, current scene back
+  // however the command ends.
+  class CommandScene {
+  public:
+    CommandScene(MotionServer& s, WorldSnapshot::ConstPtr snap, tf2::Vector3 target) : server(s)
+    {
+      server.setTaskRegion(target);
+      boost::lock_guard<boost::mutex> push(server.pushMutex);
+      server.arm.pinScene(snap->version());
+      if (!server.pushCollisionScene(snap)) {
+        ROS_WARN("Could not bring the planning scene to world version %lu", snap->version());
       }
-
-      if (dist > 2) {
-        ROS_INFO("Object %s is out of reasonable range", i->c_str());
-        continue;
+    }
+    ~CommandScene()
+    {
+      server.clearTaskRegion();
+      server.arm.unpinScene();
+      // Without the sync thread nothing else would put it back
+      if (server.syncRate <= 0) {
+        boost::lock_guard<boost::mutex> push(server.pushMutex);
+        server.pushCollisionScene(server.world.snapshot());
       }
+    }
+  private:
+    MotionServer& server;
+  };
 
-      if (i->find("cafe_table") != std::string::npos) {
-        moveit_msgs::CollisionObject planeobj;
-        planeobj.id = "table";
-
-        geometry_msgs::Pose planep;
-        planep.position.x = fetchCentered.x();
-        planep.position.y = fetchCentered.y();
-        planep.position.z = world.getTableH();
-
-        planep.orientation = tf2::toMsg(world.worldXformTimesRot(*i));
-
-        shape_msgs::SolidPrimitive primitive;
-        primitive.type = primitive.BOX;
-        primitive.dimensions.resize(3);
-        primitive.dimensions[0] = 0.95;
-        primitive.dimensions[1] = 0.95;
-        primitive.dimensions[2] = 0.05;
-
-        planeobj.primitives.push_back(primitive);
-        planeobj.primitive_poses.push_back(planep);
-        coList.push_back(planeobj);
-        continue;
-      }
+  // Limits the scene to objects near the line from the shoulder to target
+  void setTaskRegion(tf2::Vector3 target)
+  {
+    boost::lock_guard<boost::mutex> guard(syncMutex);
+    haveTaskRegion = true;
+    tf2::Vector3 pad(taskPadding, taskPadding, taskPadding);
+    taskLo = tf2::Vector3(std::min(workspaceCenter.x(), target.x()),
+                          std::min(workspaceCenter.y(), target.y()),
+                          std::min(workspaceCenter.z(), target.z())) - pad;
+    taskHi = tf2::Vector3(std::max(workspaceCenter.x(), target.x()),
+                          std::max(workspaceCenter.y(), target.y()),
+                          std::max(workspaceCenter.z(), target.z())) + pad;
+    regionVersion++;
+  }
 
-      moveit_msgs::CollisionObject co;
-      co.id = *i;
-      tf2::Transform xf = world.worldXformTimesTrans(*i);
-
-      if (objData.isInDatabase(*i)) {
-        ROS_INFO("Adding %s to collision scene", i->c_str());
-        std::vector<SubShape> shapeVec =
-          objData.getCollisionModel(objData.findDatabaseName(*i));
-        for (int j = 0; j < shapeVec.size(); j++) {
-          xf *= shapeVec[j].first;
-
-          geometry_msgs::Pose shape_pose;
-          shape_pose.position.x = xf.getOrigin().x();
-          shape_pose.position.y = xf.getOrigin().y();
-          shape_pose.position.z = xf.getOrigin().z();
-          shape_pose.orientation = tf2::toMsg(xf.getRotation());
-
-          co.primitives.push_back(shapeVec[j].second);
-          co.primitive_poses.push_back(shape_pose);
-        }
-        co.operation = co.ADD;
-        coList.push_back(co);
-      }
-      else {
-        ROS_INFO("%s was not found in the database", i->c_str());
-      }
-    }
+  void clearTaskRegion()
+  {
+    boost::lock_guard<boost::mutex> guard(syncMutex);
+    haveTaskRegion = false;
+    regionVersion++;
+  }
 
-    return coList;
+  std::vector<moveit_msgs::CollisionObject> getCollisionModels(WorldSnapshot::ConstPtr snap,
+                                                               ObjectDatabase& db)
+  {
+    bool useRegion = false;
+    tf2::Vector3 lo, hi;
+    {
+      boost::lock_guard<boost::mutex> guard(syncMutex);
+      useRegion = haveTaskRegion;
+      lo = taskLo;
+      hi = taskHi;
+    }
+    return sceneBuilder.build(*snap, db, useRegion, lo, hi);
   }
 
 private:
   ros::NodeHandle n;
   ros::AsyncSpinner spinner;
+  ros::AsyncSpinner jointSpinner;
   ros::AsyncSpinner armSpinner;
   ros::CallbackQueue armQueue;
   ros::CallbackQueue inputQueue;
+  ros::CallbackQueue jointQueue;
   ros::Subscriber obsSubscriber;
   ros::Subscriber commSubscriber;
   ros::Subscriber listSubscriber;
@@ -557,15 +897,50 @@ private:
   ros::Publisher camXPublisher;
   geometry_msgs::TransformStamped camXform;
   ros::Timer pubTimer;
+  ros::Publisher ingestPublisher;
+  ros::Timer ingestTimer;
+
+  // Conflated model states ingest
+  double obsRate;
+  ConflatingInput<gazebo_msgs::ModelStates> obsInput;
+  boost::thread obsThread;
+  boost::atomic<unsigned long> jointMessages;
+
+  // When the arm counts an object as settled
+  double settleWindow;
+  double settleTrans;
+  double settleRot;
 
   ActionState state;
   std::string failureReason;
   std::string targetID;
   bool armHomeState;
     bool list_on;
+  // Rings of extra put down candidates around a DROP target
+  int dropRings;
+
+  // Background planning scene sync
+  double syncRate;
+  boost::thread syncThread;
+  boost::mutex syncMutex;
+  // Keeps a sync push from landing after a command pins the scene
+  boost::mutex pushMutex;
+  unsigned long syncedVersion;
+  unsigned long regionVersion;
+  unsigned long syncedRegion;
+
+  // Task region for scene culling, in the robot frame
+  tf2::Vector3 workspaceCenter;
+  double taskPadding;
+  bool haveTaskRegion;
+  tf2::Vector3 taskLo;
+  tf2::Vector3 taskHi;
 
   WorldObjects world;
-  ObjectDatabase objData;
+  DatabaseStore objStore;
+  SceneBuilder sceneBuilder;
+  // Only loaded for dual planning
+  std::shared_ptr<DatabaseStore> unpaddedStore;
   ArmController arm;
 };
 
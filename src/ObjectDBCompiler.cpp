@@ -0,0 +1,71 @@
+#include <string>
+
+#include <ros/ros.h>
+
+#include "ObjectDatabase.h"
+#include "CompiledDatabase.h"
+
+// Compiles an object_info.json into the binary database the motion server
+// maps at startup, then checks that the result loads
+class ObjectDBCompiler {
+public:
+    ObjectDBCompiler() {
+        if (!n.getParam("/rosie_object_db_compiler/input_file", inFile)) {
+            ROS_WARN("ObjectDBCompiler is missing an input_file!");
+            return;
+        }
+        if (!n.getParam("/rosie_object_db_compiler/output_file", outFile)) {
+            outFile = inFile;
+            std::size_t dot = outFile.rfind(".json");
+            if (dot != std::string::npos) outFile.erase(dot);
+            outFile += ".odb";
+        }
+    }
+
+    bool compile() {
+        if (inFile == "") return false;
+
+        ros::WallTime begin = ros::WallTime::now();
+        ObjectDatabase fromJson(inFile);
+        double jsonMs = (ros::WallTime::now() - begin).toSec()*1000.0;
+        if (!fromJson.ok()) {
+            ROS_WARN("ObjectDBCompiler will not compile %s, it did not load cleanly", inFile.c_str());
+            return false;
+        }
+        if (!fromJson.compile(outFile)) return false;
+
+        begin = ros::WallTime::now();
+        CompiledDatabase check;
+        if (!check.open(outFile, inFile)) {
+            ROS_WARN("ObjectDBCompiler could not read back %s", outFile.c_str());
+            return false;
+        }
+        check.close();
+        ObjectDatabase fromBinary(inFile, outFile);
+        double binMs = (ros::WallTime::now() - begin).toSec()*1000.0;
+
+        ROS_INFO("ObjectDBCompiler wrote %s: json load %f ms, compiled load %f ms",
+                 outFile.c_str(), jsonMs, binMs);
+        return true;
+    }
+
+private:
+    ros::NodeHandle n;
+    std::string inFile;
+    std::string outFile;
+};
+
+int main(int argc, char** argv)
+{
+    ros::init(argc, argv, "rosie_object_db_compiler");
+    ObjectDBCompiler compiler;
+
+    if (compiler.compile()) {
+        ROS_INFO("ObjectDBCompiler finished successfully!");
+    } else {
+        ROS_WARN("ObjectDBCompiler encountered an error!");
+        return 1;
+    }
+
+    return 0;
+}
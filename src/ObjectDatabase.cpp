@@ -1,234 +1,219 @@
 #include "ObjectDatabase.h"
+#include "CompiledDatabase.h"
+#include "ObjectInfoLoader.h"
 
-void ObjectDatabase::reload() {
-  collisionModels.clear();
-  grasps.clear();
-  init();
+bool ObjectDatabase::isInDatabase(std::string objectID) {
+  return (resolve(objectID).dbName != "");
 }
 
-bool ObjectDatabase::isInDatabase(std::string objectID) {
-  return (dbHasGrasps(objectID) || dbHasModel(objectID));
+// Grasp entries win over collision-only entries
+const Resolution& ObjectDatabase::resolve(const std::string& objectID) {
+  boost::lock_guard<boost::mutex> guard(resolveMutex);
+  std::unordered_map<std::string, Resolution>::iterator r = resolved.find(objectID);
+  if (r != resolved.end()) return r->second;
+
+  Resolution res;
+  std::string graspName = graspIndex.firstMatching(objectID);
+  std::string modelName = modelIndex.firstMatching(objectID);
+  res.hasGrasps = (graspName != "");
+  res.hasModel = (modelName != "");
+  res.dbName = res.hasGrasps ? graspName : modelName;
+  std::map<std::string, DatabaseEntryPtr>::const_iterator e = entries.find(res.dbName);
+  res.entry = (e == entries.end() ? NULL : e->second.get());
+  return resolved.insert(std::make_pair(objectID, res)).first->second;
 }
 
 bool ObjectDatabase::dbHasGrasps(std::string objectID) {
-  for (std::map<std::string, std::vector<GraspPair> >::iterator j =
-         grasps.begin(); j != grasps.end(); j++) {
-    if (j->first.find(objectID) != std::string::npos ||
-        objectID.find(j->first) != std::string::npos) {
-      return true;
-    }
-  }
-  return false;
+  return resolve(objectID).hasGrasps;
 }
 
 bool ObjectDatabase::dbHasModel(std::string objectID) {
-  for (std::map<std::string, std::vector<SubShape> >::iterator p =
-         collisionModels.begin(); p != collisionModels.end(); p++) {
-    if (p->first.find(objectID) != std::string::npos ||
-        objectID.find(p->first) != std::string::npos) {
-      return true;
-    }
-  }
-  return false;
+  return resolve(objectID).hasModel;
 }
 
 std::string ObjectDatabase::findDatabaseName(std::string objectID) {
-  for (std::map<std::string, std::vector<GraspPair> >::iterator j =
-         grasps.begin(); j != grasps.end(); j++) {
-    if (j->first.find(objectID) != std::string::npos ||
-        objectID.find(j->first) != std::string::npos) {
-      //ROS_INFO("Found %s under GRASP database name %s", objectID.c_str(),
-      //         j->first.c_str());
-      return j->first;
-    }
-  }
-
-  for (std::map<std::string, std::vector<SubShape> >::iterator p =
-         collisionModels.begin(); p != collisionModels.end(); p++) {
-    if (p->first.find(objectID) != std::string::npos ||
-        objectID.find(p->first) != std::string::npos) {
-      //ROS_INFO("Found %s under MODEL database name %s", objectID.c_str(),
-      //         p->first.c_str());
-      return p->first;
-    }
-  }
+  const Resolution& r = resolve(objectID);
+  if (r.dbName == "") ROS_INFO("Could not find database entry for %s", objectID.c_str());
+  return r.dbName;
+}
 
-  ROS_INFO("Could not find database entry for %s", objectID.c_str());
-  return "";
+DatabaseEntryPtr ObjectDatabase::getEntry(const std::string& dbName) const {
+  std::map<std::string, DatabaseEntryPtr>::const_iterator e = entries.find(dbName);
+  if (e == entries.end()) return DatabaseEntryPtr();
+  return e->second;
 }
 
-std::vector<SubShape> ObjectDatabase::getCollisionModel(std::string dbName) {
-  return collisionModels[dbName];
+const std::vector<SubShape>& ObjectDatabase::getCollisionModel(const std::string& dbName) const {
+  static const std::vector<SubShape> none;
+  std::map<std::string, DatabaseEntryPtr>::const_iterator e = entries.find(dbName);
+  if (e == entries.end()) return none;
+  return e->second->shapes;
 }
 
-int ObjectDatabase::getNumGrasps(std::string dbName) {
-  return grasps[dbName].size();
+int ObjectDatabase::getNumGrasps(const std::string& dbName) const {
+  return getAllGrasps(dbName).size();
 }
 
-std::vector<GraspPair> ObjectDatabase::getAllGrasps(std::string dbName) {
-  return grasps[dbName];
+const std::vector<GraspPair>& ObjectDatabase::getAllGrasps(const std::string& dbName) const {
+  static const std::vector<GraspPair> none;
+  std::map<std::string, DatabaseEntryPtr>::const_iterator e = entries.find(dbName);
+  if (e == entries.end()) return none;
+  return e->second->grasps;
 }
-GraspPair ObjectDatabase::getGraspAtIndex(std::string dbName, int index) {
-  return grasps[dbName][index];
+
+const GraspPair* ObjectDatabase::getGraspAtIndex(const std::string& dbName, int index) const {
+  const std::vector<GraspPair>& g = getAllGrasps(dbName);
+  if (index < 0 || index >= g.size()) return NULL;
+  return &g[index];
 }
 
-// Reads in json specifying data about the objects the robot may find
-void ObjectDatabase::init() {
-  // OPEN FILE
-  std::ifstream jsonfile("/home/mamantov/catkin_ws/src/rosie_motion/config/object_info.json");
-  int length = 0;
-  if (jsonfile) {
-    jsonfile.seekg(0, jsonfile.end);
-    length = jsonfile.tellg();
-    jsonfile.seekg(0, jsonfile.beg);
-  }
-  else {
-    ROS_WARN("Could not init object database at all!");
-    return;
-  }
+float ObjectDatabase::getFootprintRadius(const std::string& dbName) const {
+  std::map<std::string, DatabaseEntryPtr>::const_iterator e = entries.find(dbName);
+  if (e == entries.end()) return 0.f;
+  return e->second->geometry.footprintRadius;
+}
 
-  // READ FILE
-  char* buf = new char[length];
-  jsonfile.read(buf, length);
-  // Make sure there is nothing else after the json object
-  for (int i = length-1; i > 0; i--) {
-    if (buf[i] != '}') buf[i] = 0;
-    else break;
-  }
+float ObjectDatabase::getBoundingRadius(const std::string& dbName) const {
+  std::map<std::string, DatabaseEntryPtr>::const_iterator e = entries.find(dbName);
+  if (e == entries.end()) return 0.f;
+  return e->second->geometry.boundingRadius;
+}
 
-  // CONVERT TO JSON
-  rapidjson::Document d;
-  d.Parse(buf);
-  delete[] buf;
-  jsonfile.close();
+const std::vector<shapes::ShapeConstPtr>& ObjectDatabase::getCollisionShapes(const std::string& dbName) const {
+  static const std::vector<shapes::ShapeConstPtr> none;
+  std::map<std::string, DatabaseEntryPtr>::const_iterator e = entries.find(dbName);
+  if (e == entries.end()) return none;
+  return e->second->geometry.shapes;
+}
 
-  if (d.HasParseError()) {
-    ROS_WARN("Failed to parse json file with error code %i at %i",
-             d.GetParseError(),
-             (int)d.GetErrorOffset());
+// Builds the shapes for the entry's collision model, along with the radius
+// of the circle around the object origin that covers all of them when seen
+// from above and the radius of the sphere that covers them
+void ObjectDatabase::buildGeometry(DatabaseEntry& e) {
+  CollisionGeometry& cg = e.geometry;
+  cg.footprintRadius = 0.f;
+  cg.boundingRadius = 0.f;
+  // Shape transforms compose, as in SceneBuilder::databaseObject
+  tf2::Transform xf;
+  xf.setIdentity();
+  for (int i = 0; i < e.shapes.size(); i++) {
+    const shape_msgs::SolidPrimitive& sp = e.shapes[i].second;
+    xf *= e.shapes[i].first;
+    tf2::Vector3 off = xf.getOrigin();
+    cg.shapes.push_back(shapes::ShapeConstPtr(shapes::constructShapeFromMsg(sp)));
+
+    float flatR = 0.f;
+    float fullR = 0.f;
+    if (sp.type == sp.BOX) {
+      flatR = 0.5*sqrt(sp.dimensions[0]*sp.dimensions[0] +
+                       sp.dimensions[1]*sp.dimensions[1]);
+      fullR = 0.5*sqrt(sp.dimensions[0]*sp.dimensions[0] +
+                       sp.dimensions[1]*sp.dimensions[1] +
+                       sp.dimensions[2]*sp.dimensions[2]);
+    }
+    else if (sp.type == sp.CYLINDER) {
+      flatR = sp.dimensions[1];
+      fullR = sqrt(0.25*sp.dimensions[0]*sp.dimensions[0] +
+                   sp.dimensions[1]*sp.dimensions[1]);
+    }
+    flatR += sqrt(off.x()*off.x() + off.y()*off.y());
+    fullR += off.length();
+    if (flatR > cg.footprintRadius) cg.footprintRadius = flatR;
+    if (fullR > cg.boundingRadius) cg.boundingRadius = fullR;
   }
+}
 
-  // CHECK THAT THERE IS A LIST OF OBJECTS
-  if (d.HasMember("objects")) {
-    ROS_INFO("ObjectDatabase successfully read object database json file!");
+// The first entry with a name wins. Names are matched by substring both
+// ways, so index them as they come in.
+void ObjectDatabase::addEntry(DatabaseEntryPtr e) {
+  if (!entries.insert(std::make_pair(e->name, e)).second) return;
+  modelIndex.add(e->name);
+  if (e->hasGrasps) {
+    graspIndex.add(e->name);
+    numWithGrasps++;
   }
+}
 
-  const rapidjson::Value& objs = d["objects"];
-  assert(objs.IsArray());
-
-  ROS_INFO("There are %i objects in the object_info file.", (int)objs.Size());
+void ObjectDatabase::init() {
+  if (compiledName != "" && loadCompiled()) {
+    loaded = true;
+    return;
+  }
+  if (compiledName != "") ROS_INFO("ObjectDatabase falling back to %s", fileName.c_str());
+  loaded = loadJson();
+}
 
-  // GO THROUGH ALL THE OBJECTS
-  for (int i = 0; i < objs.Size(); i++) {
-    if(!objs[i].HasMember("shapes") || !objs[i]["shapes"].IsArray()) {
-      ROS_WARN("Database object %s has no shapes, will not be added.",
-               objs[i]["name"].GetString());
-      continue;
+// No text to parse, and the transforms and radii are already computed,
+// but each entry is still copied out of the mapping. Entries hold
+// tf2 transforms, SolidPrimitive messages and the shapes::Shape objects
+// that planning scenes keep pointers to, none of which can live in the
+// file, and building them on first use would put a lock in every getter
+// the scene sync thread calls. The mapping is closed once this returns.
+bool ObjectDatabase::loadCompiled() {
+  CompiledDatabase cdb;
+  if (!cdb.open(compiledName, fileName)) return false;
+
+  for (int i = 0; i < cdb.numObjects(); i++) {
+    const CompiledDatabase::ObjectRecord& o = cdb.object(i);
+    std::string name = cdb.name(o);
+
+    std::shared_ptr<DatabaseEntry> e = std::make_shared<DatabaseEntry>();
+    e->name = name;
+    CollisionGeometry& cg = e->geometry;
+    cg.footprintRadius = o.footprintRadius;
+    cg.boundingRadius = o.boundingRadius;
+    for (int j = 0; j < o.numShapes; j++) {
+      const CompiledDatabase::ShapeRecord& sr = cdb.shape(o.firstShape + j);
+      shape_msgs::SolidPrimitive shape;
+      shape.type = sr.type;
+      shape.dimensions.assign(sr.dimensions, sr.dimensions + sr.numDimensions);
+      e->shapes.push_back(std::make_pair(CompiledDatabase::toXform(sr.xform), shape));
+      cg.shapes.push_back(shapes::ShapeConstPtr(shapes::constructShapeFromMsg(shape)));
     }
 
-    std::vector<SubShape> shapeVec;
-    for (int j = 0; j < objs[i]["shapes"].Size(); j++) {
-      shape_msgs::SolidPrimitive shape;
-      if (objs[i]["shapes"][j]["shape"] == "cylinder") {
-        shape.type = shape.CYLINDER;
-      }
-      else if (objs[i]["shapes"][j]["shape"] == "box") {
-        shape.type = shape.BOX;
-      }
-      else {
-        ROS_WARN("Unknown object type %s found!", objs[i]["shape"].GetString());
-        continue;
-      }
-
-      if (shape.type == shape.CYLINDER) {
-        if (objs[i]["shapes"][j]["dimensions"].Size() != 2) {
-          ROS_WARN("Cylinders need two elements in their dimensions.");
-          continue;
-        }
-        shape.dimensions.resize(2);
-      }
-      else if (shape.type == shape.BOX) {
-        if (objs[i]["shapes"][j]["dimensions"].Size() != 3) {
-          ROS_WARN("Boxes need three elements in their dimensions.");
-          continue;
-        }
-        shape.dimensions.resize(3);
-      }
-
-      for (int k = 0; k < shape.dimensions.size(); k++) {
-        shape.dimensions[k] = objs[i]["shapes"][j]["dimensions"][k].GetDouble();
-      }
-
-      tf2::Transform xform;
-      if (!objs[i]["shapes"][j].HasMember("transform")) {
-        xform.setIdentity();
-      } else {
-        if (!objs[i]["shapes"][j]["transform"].HasMember("translation") ||
-            !objs[i]["shapes"][j]["transform"]["translation"].IsArray() ||
-            !objs[i]["shapes"][j]["transform"].HasMember("rotation") ||
-            !objs[i]["shapes"][j]["transform"]["rotation"].IsArray()) {
-          ROS_WARN("Shape transform info is not correct.");
-          continue;
-        }
-        tf2::Vector3 trans(objs[i]["shapes"][j]["transform"]["translation"][0].GetDouble(),
-                           objs[i]["shapes"][j]["transform"]["translation"][1].GetDouble(),
-                           objs[i]["shapes"][j]["transform"]["translation"][2].GetDouble());
-
-        tf2::Quaternion rot(objs[i]["shapes"][j]["transform"]["rotation"][0].GetDouble(),
-                            objs[i]["shapes"][j]["transform"]["rotation"][1].GetDouble(),
-                            objs[i]["shapes"][j]["transform"]["rotation"][2].GetDouble(),
-                            objs[i]["shapes"][j]["transform"]["rotation"][3].GetDouble());
-        xform.setOrigin(trans);
-        xform.setRotation(rot);
-      }
-
-      SubShape ss = std::make_pair(xform, shape);
-      shapeVec.push_back(ss);
+    e->hasGrasps = (o.numGrasps != CompiledDatabase::NO_GRASPS);
+    for (int j = 0; e->hasGrasps && j < o.numGrasps; j++) {
+      const CompiledDatabase::GraspRecord& gr = cdb.grasp(o.firstGrasp + j);
+      e->grasps.push_back(std::make_pair(CompiledDatabase::toXform(gr.first),
+                                         CompiledDatabase::toXform(gr.second)));
     }
+    addEntry(e);
+  }
 
-    collisionModels.insert(std::pair<std::string,
-                           std::vector<SubShape> >(objs[i]["name"].GetString(),
-                                                   shapeVec));
+  ROS_INFO("ObjectDatabase loaded collision info for %i objects and grasp info for %i objects from %s",
+           (int)entries.size(),
+           numWithGrasps,
+           compiledName.c_str());
+  return true;
+}
 
-    if(!objs[i].HasMember("grasps") || !objs[i]["grasps"].IsArray()) {
-      ROS_WARN("Database object %s has no grasp information, only collision model.",
-               objs[i]["name"].GetString());
-      continue;
-    }
-    std::vector<GraspPair> allGrasps;
-    for (int j = 0; j < objs[i]["grasps"].Size(); j++) {
-      if (objs[i]["grasps"][j]["first"].Size() != 6 ||
-          objs[i]["grasps"][j]["second"].Size() != 6) {
-        ROS_WARN("Wrong number of elements in grasp xyzrpy for object %s, grasp %i.",
-                 objs[i]["name"].GetString(), j);
-        continue;
-      }
-      tf2::Quaternion rot1;
-      rot1.setRPY(objs[i]["grasps"][j]["first"][3].GetDouble(),
-                  objs[i]["grasps"][j]["first"][4].GetDouble(),
-                  objs[i]["grasps"][j]["first"][5].GetDouble());
-      tf2::Vector3 vec1(objs[i]["grasps"][j]["first"][0].GetDouble(),
-                        objs[i]["grasps"][j]["first"][1].GetDouble(),
-                        objs[i]["grasps"][j]["first"][2].GetDouble());
-      tf2::Transform t1(rot1, vec1);
-
-      tf2::Quaternion rot2;
-      rot2.setRPY(objs[i]["grasps"][j]["second"][3].GetDouble(),
-                  objs[i]["grasps"][j]["second"][4].GetDouble(),
-                  objs[i]["grasps"][j]["second"][5].GetDouble());
-      tf2::Vector3 vec2(objs[i]["grasps"][j]["second"][0].GetDouble(),
-                        objs[i]["grasps"][j]["second"][1].GetDouble(),
-                        objs[i]["grasps"][j]["second"][2].GetDouble());
-      tf2::Transform t2(rot2, vec2);
-
-      GraspPair gp = std::make_pair(t1, t2);
-      allGrasps.push_back(gp);
-    }
-    grasps.insert(std::pair<std::string, std::vector<GraspPair> >(objs[i]["name"].GetString(),
-                                                                  allGrasps));
+bool ObjectDatabase::compile(std::string outFile) {
+  std::vector<CompiledDatabase::Entry> out;
+  for (std::map<std::string, DatabaseEntryPtr>::const_iterator m =
+         entries.begin(); m != entries.end(); m++) {
+    CompiledDatabase::Entry e;
+    e.name = m->first;
+    e.shapes = m->second->shapes;
+    e.hasGrasps = m->second->hasGrasps;
+    e.grasps = m->second->grasps;
+    e.footprintRadius = m->second->geometry.footprintRadius;
+    e.boundingRadius = m->second->geometry.boundingRadius;
+    out.push_back(e);
+  }
+  return CompiledDatabase::write(outFile, fileName, out);
+}
+
+// Reads in json specifying data about the objects the robot may find
+bool ObjectDatabase::loadJson() {
+  ObjectInfoLoader loader;
+  std::vector<DatabaseEntryPtr> read;
+  bool ok = loader.load(fileName, read);
+  for (int i = 0; i < read.size(); i++) {
+    addEntry(read[i]);
   }
 
   ROS_INFO("ObjectDatabase loaded collision info for %i objects and grasp info for %i objects",
-           (int)collisionModels.size(),
-           (int)grasps.size());
+           (int)entries.size(),
+           numWithGrasps);
+  return ok;
 }
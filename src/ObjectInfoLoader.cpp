@@ -0,0 +1,391 @@
+#include "ObjectInfoLoader.h"
+
+#include <cstring>
+#include <cstdarg>
+#include <cstdio>
+#include <fstream>
+
+#include "rapidjson/reader.h"
+#include "rapidjson/error/en.h"
+
+// Follows where the parse is in the object_info layout, collecting what
+// each object record needs and ignoring everything else
+class ObjectInfoLoader::Handler :
+  public rapidjson::BaseReaderHandler<rapidjson::UTF8<>, ObjectInfoLoader::Handler> {
+public:
+  enum State { TOP, OBJECTS, OBJECT, SHAPES, SHAPE, DIMENSIONS, TRANSFORM,
+               TRANSLATION, ROTATION, GRASPS, GRASP, FIRST, SECOND, SKIP };
+
+  Handler(ObjectInfoLoader& l, rapidjson::InsituStringStream& s) : loader(l),
+                                                                   stream(s),
+                                                                   key(""),
+                                                                   numRecords(0),
+                                                                   inRecord(false),
+                                                                   foundObjects(false) {}
+
+  bool StartObject() { return start(false); }
+  bool StartArray() { return start(true); }
+  bool EndObject(rapidjson::SizeType) { return end(); }
+  bool EndArray(rapidjson::SizeType) { return end(); }
+
+  // In situ, keys and strings are terminated in the buffer
+  bool Key(const char* str, rapidjson::SizeType, bool) {
+    key = str;
+    if (state() == SHAPE && keyIs("transform")) record().shapes.back().hasTransform = true;
+    return true;
+  }
+
+  bool String(const char* str, rapidjson::SizeType, bool) {
+    if (state() == OBJECT && keyIs("name")) record().name = str;
+    else if (state() == SHAPE && keyIs("shape")) record().shapes.back().type = str;
+    else if (state() == OBJECTS) strayValue();
+    return true;
+  }
+
+  bool Int(int i) { return number(i); }
+  bool Uint(unsigned u) { return number(u); }
+  bool Int64(int64_t i) { return number(i); }
+  bool Uint64(uint64_t u) { return number(u); }
+  bool Double(double d) { return number(d); }
+  // Nulls and bools
+  bool Default() {
+    if (state() == OBJECTS) strayValue();
+    return true;
+  }
+
+  // Hands over the last partial chunk, dropping a record the parse did
+  // not get to the end of
+  void flush() {
+    if (inRecord) chunk->pop_back();
+    inRecord = false;
+    if (chunk && !chunk->empty()) loader.submit(chunk);
+    chunk.reset();
+  }
+
+  bool sawObjects() { return foundObjects; }
+
+private:
+  State state() { return (stack.empty() ? SKIP : stack.back()); }
+  bool keyIs(const char* k) { return (strcmp(key, k) == 0); }
+  Record& record() { return chunk->back(); }
+
+  bool start(bool isArray) {
+    State next = SKIP;
+    if (stack.empty()) {
+      if (!isArray) next = TOP;
+    }
+    else {
+      switch (stack.back()) {
+      case TOP:
+        if (isArray && keyIs("objects")) {
+          next = OBJECTS;
+          foundObjects = true;
+        }
+        break;
+      case OBJECTS:
+        newRecord();
+        record().isObject = !isArray;
+        if (!isArray) next = OBJECT;
+        break;
+      case OBJECT:
+        if (isArray && keyIs("shapes")) {
+          record().hasShapes = true;
+          next = SHAPES;
+        }
+        else if (isArray && keyIs("grasps")) {
+          record().hasGrasps = true;
+          next = GRASPS;
+        }
+        break;
+      case SHAPES:
+        if (!isArray) {
+          record().shapes.push_back(RawShape());
+          next = SHAPE;
+        }
+        break;
+      case SHAPE:
+        if (isArray && keyIs("dimensions")) next = DIMENSIONS;
+        else if (!isArray && keyIs("transform")) next = TRANSFORM;
+        break;
+      case TRANSFORM:
+        if (isArray && keyIs("translation")) {
+          record().shapes.back().hasTranslation = true;
+          next = TRANSLATION;
+        }
+        else if (isArray && keyIs("rotation")) {
+          record().shapes.back().hasRotation = true;
+          next = ROTATION;
+        }
+        break;
+      // Anything in the list counts, so a malformed grasp is reported
+      case GRASPS:
+        record().grasps.push_back(RawGrasp());
+        if (!isArray) next = GRASP;
+        break;
+      case GRASP:
+        if (isArray && keyIs("first")) next = FIRST;
+        else if (isArray && keyIs("second")) next = SECOND;
+        break;
+      default:
+        break;
+      }
+    }
+    stack.push_back(next);
+    return true;
+  }
+
+  bool end() {
+    stack.pop_back();
+    if (state() == OBJECTS) finishRecord();
+    return true;
+  }
+
+  bool number(double d) {
+    switch (state()) {
+    case DIMENSIONS: record().shapes.back().dimensions.push_back(d); break;
+    case TRANSLATION: record().shapes.back().translation.push_back(d); break;
+    case ROTATION: record().shapes.back().rotation.push_back(d); break;
+    case FIRST: record().grasps.back().first.push_back(d); break;
+    case SECOND: record().grasps.back().second.push_back(d); break;
+    case OBJECTS: strayValue(); break;
+    default: break;
+    }
+    return true;
+  }
+
+  void newRecord() {
+    if (!chunk) {
+      chunk = std::make_shared<Chunk>();
+      chunk->reserve(loader.chunkSize);
+    }
+    chunk->push_back(Record());
+    record().index = numRecords++;
+    record().offset = stream.Tell();
+    inRecord = true;
+  }
+
+  void finishRecord() {
+    inRecord = false;
+    if (chunk->size() < loader.chunkSize) return;
+    loader.submit(chunk);
+    chunk.reset();
+  }
+
+  // A number, string, bool or null directly in the objects list
+  void strayValue() {
+    newRecord();
+    record().isObject = false;
+    finishRecord();
+  }
+
+  ObjectInfoLoader& loader;
+  rapidjson::InsituStringStream& stream;
+  std::vector<State> stack;
+  const char* key;
+  std::shared_ptr<Chunk> chunk;
+  int numRecords;
+  bool inRecord;
+  bool foundObjects;
+};
+
+ObjectInfoLoader::ObjectInfoLoader(int threads, int chunk) : numThreads(threads),
+                                                             chunkSize(chunk),
+                                                             objectsRead(0),
+                                                             problemsFound(0),
+                                                             nextChunk(0),
+                                                             parsing(false) {
+  if (numThreads <= 0) numThreads = boost::thread::hardware_concurrency();
+  if (numThreads <= 0) numThreads = 1;
+  if (chunkSize < 1) chunkSize = 1;
+}
+
+bool ObjectInfoLoader::load(const std::string& fileName, std::vector<DatabaseEntryPtr>& entries) {
+  std::ifstream jsonfile(fileName, std::ios::binary);
+  if (!jsonfile) {
+    ROS_WARN("Could not init object database from %s at all!", fileName.c_str());
+    return false;
+  }
+  jsonfile.seekg(0, jsonfile.end);
+  std::streamoff length = jsonfile.tellg();
+  if (length < 0) {
+    ROS_WARN("Could not get the size of object database %s", fileName.c_str());
+    return false;
+  }
+  jsonfile.seekg(0, jsonfile.beg);
+  // Parsed in place, and the names stay here until conversion is done
+  std::vector<char> buf(length + 1, 0);
+  if (!jsonfile.read(&buf[0], length)) {
+    ROS_WARN("Could not read object database %s", fileName.c_str());
+    return false;
+  }
+  jsonfile.close();
+
+  objectsRead = 0;
+  problemsFound = 0;
+  chunks.clear();
+  nextChunk = 0;
+  parsing = true;
+
+  // This thread parses, then joins in converting
+  boost::thread_group workers;
+  for (int i = 1; i < numThreads; i++) {
+    workers.create_thread(boost::bind(&ObjectInfoLoader::workerLoop, this));
+  }
+
+  // Stopping after the top level object ignores anything after it
+  rapidjson::InsituStringStream ss(&buf[0]);
+  Handler handler(*this, ss);
+  rapidjson::Reader reader;
+  rapidjson::ParseResult ok =
+    reader.Parse<rapidjson::kParseInsituFlag | rapidjson::kParseStopWhenDoneFlag>(ss, handler);
+  handler.flush();
+  {
+    boost::lock_guard<boost::mutex> guard(chunkMutex);
+    parsing = false;
+  }
+  chunkReady.notify_all();
+  workerLoop();
+  workers.join_all();
+
+  for (int c = 0; c < chunks.size(); c++) {
+    for (int i = 0; i < chunks[c]->size(); i++) {
+      const Record& r = (*chunks[c])[i];
+      objectsRead++;
+      for (int k = 0; k < r.problems.size(); k++) {
+        ROS_WARN("Database object %i (%s, byte %lu): %s",
+                 r.index, (r.name ? r.name : "no name"), (unsigned long)r.offset,
+                 r.problems[k].c_str());
+        problemsFound++;
+      }
+      // Collision-only objects are expected, not a problem
+      if (r.entry && !r.hasGrasps) {
+        ROS_DEBUG("Database object %s has no grasp information, only collision model.", r.name);
+      }
+      if (r.entry) entries.push_back(r.entry);
+    }
+  }
+  chunks.clear();
+
+  if (ok.IsError()) {
+    ROS_WARN("Failed to parse %s: %s at byte %lu, keeping the %i objects before it",
+             fileName.c_str(),
+             rapidjson::GetParseError_En(ok.Code()),
+             (unsigned long)ok.Offset(),
+             objectsRead);
+    return false;
+  }
+  if (!handler.sawObjects()) {
+    ROS_WARN("%s has no list of objects!", fileName.c_str());
+    return false;
+  }
+  ROS_INFO("There are %i objects in the object_info file.", objectsRead);
+  return true;
+}
+
+void ObjectInfoLoader::submit(std::shared_ptr<Chunk> c) {
+  {
+    boost::lock_guard<boost::mutex> guard(chunkMutex);
+    chunks.push_back(c);
+  }
+  chunkReady.notify_one();
+}
+
+void ObjectInfoLoader::workerLoop() {
+  while (true) {
+    std::shared_ptr<Chunk> c;
+    {
+      boost::unique_lock<boost::mutex> lock(chunkMutex);
+      while (nextChunk == chunks.size() && parsing) chunkReady.wait(lock);
+      if (nextChunk == chunks.size()) return;
+      c = chunks[nextChunk++];
+    }
+    for (int i = 0; i < c->size(); i++) convert((*c)[i]);
+  }
+}
+
+static void addProblem(std::vector<std::string>& problems, const char* format, ...) {
+  char msg[256];
+  va_list args;
+  va_start(args, format);
+  vsnprintf(msg, sizeof(msg), format, args);
+  va_end(args);
+  problems.push_back(msg);
+}
+
+// Grasps are x y z roll pitch yaw
+static tf2::Transform xyzrpy(const std::vector<double>& v) {
+  tf2::Quaternion rot;
+  rot.setRPY(v[3], v[4], v[5]);
+  return tf2::Transform(rot, tf2::Vector3(v[0], v[1], v[2]));
+}
+
+// Same rules as always: bad shapes and grasps are dropped from an object
+// that is otherwise kept, but an object needs a name and a shape list
+void ObjectInfoLoader::convert(Record& r) {
+  if (!r.isObject) {
+    addProblem(r.problems, "is not an object, will not be added.");
+    return;
+  }
+  if (!r.name) {
+    addProblem(r.problems, "has no name, will not be added.");
+    return;
+  }
+  if (!r.hasShapes) {
+    addProblem(r.problems, "has no shapes, will not be added.");
+    return;
+  }
+
+  std::shared_ptr<DatabaseEntry> e = std::make_shared<DatabaseEntry>();
+  e->name = r.name;
+  for (int j = 0; j < r.shapes.size(); j++) {
+    const RawShape& rs = r.shapes[j];
+    shape_msgs::SolidPrimitive shape;
+    int numDimensions = 0;
+    if (rs.type && strcmp(rs.type, "cylinder") == 0) {
+      shape.type = shape.CYLINDER;
+      numDimensions = 2;
+    }
+    else if (rs.type && strcmp(rs.type, "box") == 0) {
+      shape.type = shape.BOX;
+      numDimensions = 3;
+    }
+    else {
+      addProblem(r.problems, "shape %i has unknown type %s.", j, (rs.type ? rs.type : "(none)"));
+      continue;
+    }
+
+    if (rs.dimensions.size() != numDimensions) {
+      addProblem(r.problems, "shape %i is a %s and needs %i dimensions, not %i.",
+                 j, rs.type, numDimensions, (int)rs.dimensions.size());
+      continue;
+    }
+    shape.dimensions = rs.dimensions;
+
+    tf2::Transform xform;
+    xform.setIdentity();
+    if (rs.hasTransform) {
+      if (!rs.hasTranslation || rs.translation.size() != 3 ||
+          !rs.hasRotation || rs.rotation.size() != 4) {
+        addProblem(r.problems, "shape %i transform needs a 3 element translation and a 4 element rotation.", j);
+        continue;
+      }
+      xform.setOrigin(tf2::Vector3(rs.translation[0], rs.translation[1], rs.translation[2]));
+      xform.setRotation(tf2::Quaternion(rs.rotation[0], rs.rotation[1],
+                                        rs.rotation[2], rs.rotation[3]));
+    }
+    e->shapes.push_back(std::make_pair(xform, shape));
+  }
+  ObjectDatabase::buildGeometry(*e);
+
+  e->hasGrasps = r.hasGrasps;
+  for (int j = 0; j < r.grasps.size(); j++) {
+    if (r.grasps[j].first.size() != 6 || r.grasps[j].second.size() != 6) {
+      addProblem(r.problems, "grasp %i needs xyzrpy (6 elements) in first and second, has %i and %i.",
+                 j, (int)r.grasps[j].first.size(), (int)r.grasps[j].second.size());
+      continue;
+    }
+    e->grasps.push_back(std::make_pair(xyzrpy(r.grasps[j].first),
+                                       xyzrpy(r.grasps[j].second)));
+  }
+  r.entry = e;
+}
@@ -0,0 +1,114 @@
+#include "PoseHistory.h"
+
+void PoseHistory::add(Track& tr, ros::Time stamp, const tf2::Vector3& p, const tf2::Quaternion& q) {
+  // Same stamp again overwrites the newest sample
+  if (tr.count > 0 && tr.stamps[slot(tr, tr.count - 1)] >= stamp) {
+    tr.head = (tr.head - 1 + capacity) % capacity;
+    tr.count--;
+  }
+  tr.stamps[tr.head] = stamp;
+  tr.positions[tr.head] = p;
+  tr.rotations[tr.head] = q;
+  tr.head = (tr.head + 1) % capacity;
+  if (tr.count < capacity) tr.count++;
+}
+
+void PoseHistory::record(const WorldSnapshot& snap, ros::Time stamp) {
+  records++;
+
+  // Known objects only need their own track locked
+  std::vector<int> added;
+  bool removed = false;
+  {
+    boost::shared_lock<boost::shared_mutex> lock(indexMutex);
+    for (int id = 0; id < snap.numObjects(); id++) {
+      TrackMap::iterator t = tracks.find(snap.nameOf(id));
+      if (t == tracks.end()) {
+        added.push_back(id);
+        continue;
+      }
+      Track& tr = *t->second;
+      boost::lock_guard<boost::mutex> guard(tr.mutex);
+      add(tr, stamp, snap.positionAt(id), snap.rotationAt(id));
+      tr.seen = records;
+    }
+    removed = ((int)tracks.size() > snap.numObjects() - (int)added.size());
+  }
+  if (added.empty() && !removed) return;
+
+  boost::unique_lock<boost::shared_mutex> lock(indexMutex);
+  for (TrackMap::iterator t = tracks.begin(); removed && t != tracks.end(); ) {
+    if (t->second->seen != records) {
+      t = tracks.erase(t);
+    } else {
+      t++;
+    }
+  }
+  for (int i = 0; i < added.size(); i++) {
+    std::shared_ptr<Track> tr = std::make_shared<Track>();
+    tr->stamps.resize(capacity);
+    tr->positions.resize(capacity);
+    tr->rotations.resize(capacity);
+    tr->head = 0;
+    tr->count = 0;
+    add(*tr, stamp, snap.positionAt(added[i]), snap.rotationAt(added[i]));
+    tr->seen = records;
+    tracks[snap.nameOf(added[i])] = tr;
+  }
+}
+
+bool PoseHistory::getXformAt(const std::string& name, ros::Time t, tf2::Transform& xf) {
+  boost::shared_lock<boost::shared_mutex> lock(indexMutex);
+  TrackMap::const_iterator ti = tracks.find(name);
+  if (ti == tracks.end()) return false;
+  const Track& tr = *ti->second;
+  boost::lock_guard<boost::mutex> guard(ti->second->mutex);
+  if (tr.count == 0) return false;
+
+  int first = slot(tr, 0);
+  int last = slot(tr, tr.count - 1);
+  if (t < tr.stamps[first] || t > tr.stamps[last]) return false;
+  if (t == tr.stamps[last]) {
+    xf = tf2::Transform(tr.rotations[last], tr.positions[last]);
+    return true;
+  }
+
+  // Binary search for the last sample at or before t
+  int lo = 0;
+  int hi = tr.count - 1;
+  while (hi - lo > 1) {
+    int mid = (lo + hi) / 2;
+    if (tr.stamps[slot(tr, mid)] <= t) lo = mid;
+    else hi = mid;
+  }
+  int a = slot(tr, lo);
+  int b = slot(tr, hi);
+  double span = (tr.stamps[b] - tr.stamps[a]).toSec();
+  double f = span > 0 ? (t - tr.stamps[a]).toSec() / span : 0.0;
+  f = std::min(1.0, std::max(0.0, f));
+
+  xf = tf2::Transform(tf2::slerp(tr.rotations[a], tr.rotations[b], f),
+                      tf2::lerp(tr.positions[a], tr.positions[b], f));
+  return true;
+}
+
+bool PoseHistory::isStationary(const std::string& name, ros::Time now, ros::Duration window,
+                               double trans, double rot) {
+  boost::shared_lock<boost::shared_mutex> lock(indexMutex);
+  TrackMap::const_iterator ti = tracks.find(name);
+  if (ti == tracks.end()) return false;
+  const Track& tr = *ti->second;
+  boost::lock_guard<boost::mutex> guard(ti->second->mutex);
+  if (tr.count == 0 || tr.stamps[slot(tr, 0)] > now - window) return false;
+
+  int last = slot(tr, tr.count - 1);
+  const tf2::Vector3& p = tr.positions[last];
+  const tf2::Quaternion& q = tr.rotations[last];
+  for (int i = tr.count - 2; i >= 0; i--) {
+    int s = slot(tr, i);
+    if (tr.positions[s].distance(p) > trans) return false;
+    if (q.angleShortestPath(tr.rotations[s]) > rot) return false;
+    if (tr.stamps[s] <= now - window) break;
+  }
+  return true;
+}
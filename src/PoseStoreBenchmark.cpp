@@ -0,0 +1,136 @@
+#include <string>
+#include <vector>
+#include <map>
+
+#include <ros/ros.h>
+#include <boost/thread.hpp>
+#include <boost/atomic.hpp>
+
+#include "gazebo_msgs/ModelStates.h"
+
+#include "WorldObjects.h"
+#include "SyntheticScene.h"
+
+// The pose store as it was before snapshots: one mutex around two maps
+// that are cleared and rebuilt on every message
+class LockedPoseStore {
+public:
+    void update(const gazebo_msgs::ModelStates::ConstPtr& msg) {
+        boost::lock_guard<boost::mutex> guard(objMutex);
+        objectPoses.clear();
+        objectRotations.clear();
+        for (int i = 0; i < msg->name.size(); i++) {
+            tf2::Vector3 v;
+            tf2::fromMsg(msg->pose[i].position, v);
+            objectPoses.insert(std::pair<std::string, tf2::Vector3>(msg->name[i], v));
+            tf2::Quaternion quat;
+            tf2::fromMsg(msg->pose[i].orientation, quat);
+            objectRotations.insert(std::pair<std::string, tf2::Quaternion>(msg->name[i], quat));
+        }
+    }
+
+    tf2::Transform getXformOf(const std::string& name) {
+        boost::lock_guard<boost::mutex> guard(objMutex);
+        return tf2::Transform(objectRotations[name], objectPoses[name]);
+    }
+
+private:
+    std::map<std::string, tf2::Vector3> objectPoses;
+    std::map<std::string, tf2::Quaternion> objectRotations;
+    boost::mutex objMutex;
+};
+
+// Runs one writer feeding model_states as fast as it can against reader
+// threads looking up poses, for the old locked store and for WorldObjects
+class PoseStoreBenchmark {
+public:
+    PoseStoreBenchmark() : numObjects(100),
+                           numReaders(4),
+                           seconds(2.0) {
+        n.getParam("/rosie_pose_store_benchmark/objects", numObjects);
+        n.getParam("/rosie_pose_store_benchmark/readers", numReaders);
+        n.getParam("/rosie_pose_store_benchmark/seconds", seconds);
+
+        SyntheticScene synth;
+        gazebo_msgs::ModelStates ms = synth.makeStates(numObjects);
+        msg = gazebo_msgs::ModelStates::ConstPtr(new gazebo_msgs::ModelStates(ms));
+        for (int i = 0; i < ms.name.size(); i++) {
+            if (ms.name[i].find("fetch") == std::string::npos) names.push_back(ms.name[i]);
+        }
+    }
+
+    void run() {
+        LockedPoseStore locked;
+        measure("locked maps",
+                boost::bind(&LockedPoseStore::update, &locked, msg),
+                boost::bind(&PoseStoreBenchmark::readLocked, this, &locked, _1));
+
+        WorldObjects world;
+        measure("snapshots",
+                boost::bind(&WorldObjects::update, &world, msg, ros::Time()),
+                boost::bind(&PoseStoreBenchmark::readSnapshot, this, &world, _1));
+    }
+
+private:
+    double readLocked(LockedPoseStore* store, int i) {
+        return store->getXformOf(names[i % names.size()]).getOrigin().x();
+    }
+
+    double readSnapshot(WorldObjects* world, int i) {
+        return world->snapshot()->getXformOf(names[i % names.size()]).getOrigin().x();
+    }
+
+    void measure(std::string label,
+                 boost::function<void()> write,
+                 boost::function<double(int)> read) {
+        boost::atomic<bool> running(true);
+        boost::atomic<unsigned long> writes(0);
+        std::vector<unsigned long> reads(numReaders, 0);
+
+        boost::thread_group threads;
+        threads.create_thread([&]() {
+            while (running) {
+                write();
+                writes++;
+            }
+        });
+        for (int r = 0; r < numReaders; r++) {
+            threads.create_thread([&, r]() {
+                // Keep the result live so the lookups are not optimized away
+                volatile double sink = 0;
+                unsigned long count = 0;
+                while (running) {
+                    sink += read(count + r);
+                    count++;
+                }
+                reads[r] = count;
+            });
+        }
+
+        ros::WallDuration(seconds).sleep();
+        running = false;
+        threads.join_all();
+
+        unsigned long totalReads = 0;
+        for (int r = 0; r < numReaders; r++) totalReads += reads[r];
+        ROS_INFO("PoseStoreBenchmark %s: %i objects, %i readers: %f updates/s, %f reads/s",
+                 label.c_str(), (int)names.size(), numReaders,
+                 writes / seconds, totalReads / seconds);
+    }
+
+    ros::NodeHandle n;
+    int numObjects;
+    int numReaders;
+    double seconds;
+
+    gazebo_msgs::ModelStates::ConstPtr msg;
+    std::vector<std::string> names;
+};
+
+int main(int argc, char** argv)
+{
+    ros::init(argc, argv, "rosie_pose_store_benchmark");
+    PoseStoreBenchmark psb;
+    psb.run();
+    return 0;
+}
@@ -0,0 +1,155 @@
+#include <string>
+#include <vector>
+#include <fstream>
+
+#include <ros/ros.h>
+#include <actionlib/server/simple_action_server.h>
+
+#include "control_msgs/GripperCommandAction.h"
+#include "gazebo_msgs/ModelStates.h"
+
+#include "ObjectDatabase.h"
+#include "WorldObjects.h"
+#include "SceneBuilder.h"
+#include "ArmController.h"
+#include "SyntheticScene.h"
+
+// Times each stage of getting the world into a plan as the number of
+// objects grows, on synthetic scenes. Needs move_group but not Gazebo.
+class ScaleBenchmark {
+public:
+    ScaleBenchmark() : numModels(20),
+                       seed(1),
+                       reps(20),
+                       dbFile("synthetic_object_info.json"),
+                       outFile("scale_benchmark.csv"),
+                       gripperServer(n, "gripper_controller/gripper_action",
+                                     boost::bind(&ScaleBenchmark::gripperGoal, this, _1),
+                                     false) {
+        n.getParam("/rosie_scale_benchmark/num_models", numModels);
+        n.getParam("/rosie_scale_benchmark/seed", seed);
+        n.getParam("/rosie_scale_benchmark/repetitions", reps);
+        n.getParam("/rosie_scale_benchmark/database_file", dbFile);
+        n.getParam("/rosie_scale_benchmark/output_file", outFile);
+        if (!n.getParam("/rosie_scale_benchmark/object_counts", counts)) {
+            int c[] = {10, 50, 100, 250, 500, 1000, 2000};
+            counts.assign(c, c + 7);
+        }
+
+        // ArmController waits for a gripper, so answer for one
+        gripperServer.start();
+    }
+
+    bool run() {
+        SyntheticScene synth(numModels, seed);
+        if (!synth.writeDatabase(dbFile)) return false;
+
+        std::shared_ptr<ObjectDatabase> db = std::make_shared<ObjectDatabase>(dbFile);
+        WorldObjects world;
+        SceneBuilder builder;
+        ArmController arm(n, true);
+        arm.setObjectDatabase(db);
+        arm.setHumanChecks(false);
+        arm.setLibrary("ompl");
+        arm.setPlanner("rrtc");
+        arm.setPlanningTime(5.0);
+        arm.setDirectPaths(false);
+
+        std::vector<tf2::Transform> target;
+        tf2::Quaternion down;
+        down.setRPY(0, M_PI/2, 0);
+        target.push_back(tf2::Transform(down, tf2::Vector3(0.6, 0.0, 0.95)));
+
+        std::ofstream ofs(outFile);
+        ofs << "objects,scene_objects,update_ms,build_ms,scene_add_ms,scene_move_ms,plan_ms,planned,clearance_ms"
+            << std::endl;
+
+        for (int c = 0; c < counts.size(); c++) {
+            gazebo_msgs::ModelStates::Ptr ms(new gazebo_msgs::ModelStates(synth.makeStates(counts[c])));
+
+            ros::WallTime begin = ros::WallTime::now();
+            for (int i = 0; i < reps; i++) world.update(ms);
+            double updateMs = msSince(begin) / reps;
+
+            std::vector<moveit_msgs::CollisionObject> cos;
+            WorldSnapshot::ConstPtr snap = world.snapshot();
+            begin = ros::WallTime::now();
+            for (int i = 0; i < reps; i++) cos = builder.build(*snap, *db, false, tf2::Vector3(), tf2::Vector3());
+            double buildMs = msSince(begin) / reps;
+
+            begin = ros::WallTime::now();
+            arm.updateCollisionScene(cos, snap->version());
+            double addMs = msSince(begin);
+
+            synth.jitter(*ms, 0.02);
+            world.update(ms);
+            snap = world.snapshot();
+            cos = builder.build(*snap, *db, false, tf2::Vector3(), tf2::Vector3());
+            begin = ros::WallTime::now();
+            arm.updateCollisionScene(cos, snap->version());
+            double moveMs = msSince(begin);
+
+            begin = ros::WallTime::now();
+            bool planned = arm.planToTargetList(target, 1);
+            double planMs = msSince(begin);
+
+            double clearMs = 0;
+            if (planned) {
+                begin = ros::WallTime::now();
+                arm.clearanceData(arm.getCurrentTrajectory());
+                clearMs = msSince(begin);
+            }
+
+            ROS_INFO("ScaleBenchmark %i objects (%i in scene): update %f ms, build %f ms, scene add %f ms, move %f ms, plan %f ms (%s), clearance %f ms",
+                     counts[c], (int)cos.size(), updateMs, buildMs, addMs, moveMs,
+                     planMs, planned ? "ok" : "failed", clearMs);
+            ofs << counts[c] << "," << cos.size() << "," << updateMs << "," << buildMs << ","
+                << addMs << "," << moveMs << "," << planMs << "," << planned << ","
+                << clearMs << std::endl;
+
+            // Empty the scene for the next size
+            arm.updateCollisionScene(std::vector<moveit_msgs::CollisionObject>());
+        }
+        ofs.close();
+        ROS_INFO("ScaleBenchmark wrote results to %s", outFile.c_str());
+        return true;
+    }
+
+private:
+    static double msSince(ros::WallTime begin) {
+        return (ros::WallTime::now() - begin).toSec()*1000.0;
+    }
+
+    void gripperGoal(const control_msgs::GripperCommandGoalConstPtr& goal) {
+        control_msgs::GripperCommandResult result;
+        result.position = goal->command.position;
+        result.reached_goal = true;
+        gripperServer.setSucceeded(result);
+    }
+
+    ros::NodeHandle n;
+    int numModels;
+    int seed;
+    int reps;
+    std::vector<int> counts;
+    std::string dbFile;
+    std::string outFile;
+    actionlib::SimpleActionServer<control_msgs::GripperCommandAction> gripperServer;
+};
+
+int main(int argc, char** argv)
+{
+    ros::init(argc, argv, "rosie_scale_benchmark");
+
+    ros::AsyncSpinner spinner(4);
+    spinner.start();
+
+    ScaleBenchmark sb;
+    if (sb.run()) {
+        ROS_INFO("ScaleBenchmark finished successfully!");
+    } else {
+        ROS_WARN("ScaleBenchmark encountered an error!");
+    }
+
+    return 0;
+}
@@ -0,0 +1,198 @@
+#include "SceneBuilder.h"
+
+void SceneBuilder::setWorkspace(tf2::Vector3 center, double radius) {
+  workspaceCenter = center;
+  workspaceRadius = radius;
+}
+
+moveit_msgs::CollisionObject SceneBuilder::databaseObject(const WorldSnapshot& world,
+                                                          std::string id,
+                                                          ObjectDatabase& db) {
+  return databaseObject(id, db.findDatabaseName(id), world.worldXformTimesTrans(id), db);
+}
+
+moveit_msgs::CollisionObject SceneBuilder::databaseObject(const std::string& id,
+                                                          const std::string& dbName,
+                                                          tf2::Transform xf,
+                                                          ObjectDatabase& db) {
+  moveit_msgs::CollisionObject co;
+  co.id = id;
+
+  // The database name lets the arm reuse the prebuilt geometry
+  co.type.key = dbName;
+  const std::vector<SubShape>& shapeVec = db.getCollisionModel(co.type.key);
+  for (int j = 0; j < shapeVec.size(); j++) {
+    xf *= shapeVec[j].first;
+
+    geometry_msgs::Pose shape_pose;
+    shape_pose.position.x = xf.getOrigin().x();
+    shape_pose.position.y = xf.getOrigin().y();
+    shape_pose.position.z = xf.getOrigin().z();
+    shape_pose.orientation = tf2::toMsg(xf.getRotation());
+
+    co.primitives.push_back(shapeVec[j].second);
+    co.primitive_poses.push_back(shape_pose);
+  }
+  co.operation = co.ADD;
+  return co;
+}
+
+// Ground, table, and the database objects that survive culling
+std::vector<moveit_msgs::CollisionObject> SceneBuilder::build(const WorldSnapshot& world,
+                                                              ObjectDatabase& db,
+                                                              bool useRegion,
+                                                              tf2::Vector3 lo,
+                                                              tf2::Vector3 hi) {
+  std::vector<moveit_msgs::CollisionObject> coList;
+
+  // Everything is indexed by the snapshot's object ids, with the world
+  // transform applied to all objects up front
+  int numObjects = world.numObjects();
+  std::vector<tf2::Transform> xforms;
+  world.worldXforms(xforms);
+  std::vector<const Resolution*> entries(numObjects, NULL);
+  for (int id = 0; id < numObjects; id++) {
+    const std::string& name = world.nameOf(id);
+    if (name.find("ground_plane") != std::string::npos ||
+        name.find("cafe_table") != std::string::npos) continue;
+    const Resolution& r = db.resolve(name);
+    if (r.dbName != "") entries[id] = &r;
+  }
+
+  // Keep the grid of database objects' bounding spheres in step with
+  // this snapshot; only objects that moved, appeared or vanished touch it
+  buildStamp++;
+  int numIndexed = 0;
+  for (int id = 0; id < numObjects; id++) {
+    if (!entries[id]) continue;
+    numIndexed++;
+    tf2::Vector3 center = xforms[id].getOrigin();
+    double radius = entries[id]->entry->geometry.boundingRadius;
+
+    std::unordered_map<std::string, Indexed>::iterator ix = indexed.find(world.nameOf(id));
+    if (ix == indexed.end()) {
+      Indexed in;
+      if (!freeGridIds.empty()) {
+        in.gridId = freeGridIds.back();
+        freeGridIds.pop_back();
+      } else {
+        in.gridId = snapIds.size();
+        snapIds.push_back(-1);
+      }
+      in.radius = -1;
+      ix = indexed.insert(std::make_pair(world.nameOf(id), in)).first;
+    }
+    Indexed& in = ix->second;
+    if (in.radius != radius || in.center != center) {
+      grid.insert(in.gridId, center, radius);
+      in.center = center;
+      in.radius = radius;
+    }
+    in.stamp = buildStamp;
+    snapIds[in.gridId] = id;
+  }
+  for (std::unordered_map<std::string, Indexed>::iterator ix = indexed.begin();
+       ix != indexed.end();) {
+    if (ix->second.stamp == buildStamp) {
+      ix++;
+      continue;
+    }
+    grid.remove(ix->second.gridId);
+    freeGridIds.push_back(ix->second.gridId);
+    ix = indexed.erase(ix);
+  }
+
+  // Keep the ones inside the arm's workspace and the current task region
+  std::vector<bool> keep(numObjects, false);
+  std::vector<int> inReach = grid.querySphere(workspaceCenter, workspaceRadius);
+  if (useRegion) {
+    std::vector<bool> inRegion(numObjects, false);
+    std::vector<int> r = grid.queryBox(lo, hi);
+    for (int j = 0; j < r.size(); j++) inRegion[snapIds[r[j]]] = true;
+    for (int j = 0; j < inReach.size(); j++) keep[snapIds[inReach[j]]] = inRegion[snapIds[inReach[j]]];
+  } else {
+    for (int j = 0; j < inReach.size(); j++) keep[snapIds[inReach[j]]] = true;
+  }
+
+  int numKept = 0;
+  for (int id = 0; id < numObjects; id++) {
+    const std::string& name = world.nameOf(id);
+    const tf2::Vector3& fetchCentered = xforms[id].getOrigin();
+    // Check if the fetch could actually hit this
+    float dist = tf2::tf2Distance(tf2::Vector3(0, 0, 0),
+                                  fetchCentered);
+
+    if (name.find("ground_plane") != std::string::npos) {
+      moveit_msgs::CollisionObject planeobj;
+      planeobj.id = "ground";
+
+      geometry_msgs::Pose planep;
+      planep.position.x = 0;
+      planep.position.y = 0;
+      planep.position.z = -0.025;
+
+      planep.orientation = tf2::toMsg(xforms[id].getRotation());
+
+      shape_msgs::SolidPrimitive primitive;
+      primitive.type = primitive.BOX;
+      primitive.dimensions.resize(3);
+      primitive.dimensions[0] = 2.0;
+      primitive.dimensions[1] = 2.0;
+      primitive.dimensions[2] = 0.05;
+
+      planeobj.primitives.push_back(primitive);
+      planeobj.primitive_poses.push_back(planep);
+      coList.push_back(planeobj);
+      continue;
+    }
+
+    if (dist > 2) {
+      ROS_DEBUG("Object %s is out of reasonable range", name.c_str());
+      continue;
+    }
+
+    if (name.find("cafe_table") != std::string::npos) {
+      moveit_msgs::CollisionObject planeobj;
+      planeobj.id = "table";
+
+      geometry_msgs::Pose planep;
+      planep.position.x = fetchCentered.x();
+      planep.position.y = fetchCentered.y();
+      planep.position.z = world.getTableH();
+
+      planep.orientation = tf2::toMsg(xforms[id].getRotation());
+
+      shape_msgs::SolidPrimitive primitive;
+      primitive.type = primitive.BOX;
+      primitive.dimensions.resize(3);
+      primitive.dimensions[0] = 0.95;
+      primitive.dimensions[1] = 0.95;
+      primitive.dimensions[2] = 0.05;
+
+      planeobj.primitives.push_back(primitive);
+      planeobj.primitive_poses.push_back(planep);
+      coList.push_back(planeobj);
+      continue;
+    }
+
+    if (!entries[id]) {
+      ROS_DEBUG("%s was not found in the database", name.c_str());
+      continue;
+    }
+    if (!keep[id]) {
+      ROS_DEBUG("Object %s is outside the workspace or task region", name.c_str());
+      continue;
+    }
+
+    ROS_DEBUG("Adding %s to collision scene", name.c_str());
+    coList.push_back(databaseObject(name, entries[id]->dbName, xforms[id], db));
+    numKept++;
+  }
+
+  if (numIndexed - numKept != lastCulled) {
+    ROS_INFO("Collision scene has %i of %i database objects, %i culled",
+             numKept, numIndexed, numIndexed - numKept);
+    lastCulled = numIndexed - numKept;
+  }
+  return coList;
+}
@@ -0,0 +1,45 @@
+#include <string>
+
+#include <ros/ros.h>
+
+#include "gazebo_msgs/ModelStates.h"
+
+#include "SyntheticScene.h"
+
+// Stands in for Gazebo: writes a synthetic object database and publishes
+// model states for it, so the motion server can run on large scenes
+int main(int argc, char** argv)
+{
+    ros::init(argc, argv, "rosie_scene_generator");
+    ros::NodeHandle n;
+
+    int numObjects = 100;
+    int numModels = 20;
+    int seed = 1;
+    double rate = 100.0;
+    double jitter = 0.001;
+    std::string dbFile = "synthetic_object_info.json";
+    n.getParam("/rosie_scene_generator/num_objects", numObjects);
+    n.getParam("/rosie_scene_generator/num_models", numModels);
+    n.getParam("/rosie_scene_generator/seed", seed);
+    n.getParam("/rosie_scene_generator/rate", rate);
+    n.getParam("/rosie_scene_generator/jitter", jitter);
+    n.getParam("/rosie_scene_generator/database_file", dbFile);
+
+    SyntheticScene synth(numModels, seed);
+    if (!synth.writeDatabase(dbFile)) return 1;
+    gazebo_msgs::ModelStates base = synth.makeStates(numObjects);
+    ROS_INFO("SceneGenerator wrote %i models to %s, publishing %i objects at %f Hz",
+             numModels, dbFile.c_str(), numObjects, rate);
+
+    ros::Publisher pub = n.advertise<gazebo_msgs::ModelStates>("gazebo/model_states", 10);
+    ros::Rate r(rate);
+    while (ros::ok()) {
+        // Perception noise around fixed poses, like a settled Gazebo world
+        gazebo_msgs::ModelStates ms = base;
+        synth.jitter(ms, jitter);
+        pub.publish(ms);
+        r.sleep();
+    }
+    return 0;
+}
@@ -0,0 +1,161 @@
+#include "SceneMirror.h"
+
+#include <cmath>
+#include <algorithm>
+
+std::size_t SceneMirror::geometryDigest(const moveit_msgs::CollisionObject& co) {
+  std::size_t seed = co.primitives.size();
+  for (int i = 0; i < co.primitives.size(); i++) {
+    boost::hash_combine(seed, co.primitives[i].type);
+    for (int k = 0; k < co.primitives[i].dimensions.size(); k++) {
+      boost::hash_combine(seed, co.primitives[i].dimensions[k]);
+    }
+  }
+  return seed;
+}
+
+std::size_t SceneMirror::poseDigest(const moveit_msgs::CollisionObject& co) {
+  std::size_t seed = co.primitive_poses.size();
+  for (int i = 0; i < co.primitive_poses.size(); i++) {
+    const geometry_msgs::Pose& p = co.primitive_poses[i];
+    boost::hash_combine(seed, p.position.x);
+    boost::hash_combine(seed, p.position.y);
+    boost::hash_combine(seed, p.position.z);
+    boost::hash_combine(seed, p.orientation.x);
+    boost::hash_combine(seed, p.orientation.y);
+    boost::hash_combine(seed, p.orientation.z);
+    boost::hash_combine(seed, p.orientation.w);
+  }
+  return seed;
+}
+
+void SceneMirror::setJitterThresholds(double trans, double rot) {
+  transThreshold = trans;
+  rotThreshold = rot;
+}
+
+bool SceneMirror::movedBeyondThresholds(const moveit_msgs::CollisionObject& from,
+                                        const moveit_msgs::CollisionObject& to) {
+  if (from.primitive_poses.size() != to.primitive_poses.size()) return true;
+
+  for (int i = 0; i < to.primitive_poses.size(); i++) {
+    const geometry_msgs::Pose& a = from.primitive_poses[i];
+    const geometry_msgs::Pose& b = to.primitive_poses[i];
+    double dx = a.position.x - b.position.x;
+    double dy = a.position.y - b.position.y;
+    double dz = a.position.z - b.position.z;
+    if (sqrt(dx*dx + dy*dy + dz*dz) > transThreshold) return true;
+
+    double dot = fabs(a.orientation.x*b.orientation.x + a.orientation.y*b.orientation.y +
+                      a.orientation.z*b.orientation.z + a.orientation.w*b.orientation.w);
+    if (2*acos(std::min(dot, 1.0)) > rotThreshold) return true;
+  }
+  return false;
+}
+
+void SceneMirror::reset(const std::vector<moveit_msgs::CollisionObject>& world) {
+  objects.clear();
+  for (int i = 0; i < world.size(); i++) {
+    add(world[i]);
+  }
+}
+
+bool SceneMirror::diff(const std::vector<moveit_msgs::CollisionObject>& requested,
+                       const std::string& ignoreID,
+                       const std::string& frame,
+                       std::vector<moveit_msgs::CollisionObject>& ops) {
+  int numOps = ops.size();
+  std::unordered_set<std::string> seen;
+  pendingSet.clear();
+  pendingRemove.clear();
+
+  for (int i = 0; i < requested.size(); i++) {
+    const moveit_msgs::CollisionObject& co = requested[i];
+    if (co.id == ignoreID) continue;
+    seen.insert(co.id);
+
+    std::unordered_map<std::string, Entry>::iterator e = objects.find(co.id);
+    // New objects are added
+    if (e == objects.end()) {
+      ops.push_back(co);
+      ops.back().header.frame_id = frame;
+      ops.back().operation = co.ADD;
+      pendingSet.push_back(co);
+      continue;
+    }
+
+    // To change the size, you have to remove it and add again
+    if (e->second.geometryDigest != geometryDigest(co)) {
+      moveit_msgs::CollisionObject removal;
+      removal.header.frame_id = frame;
+      removal.id = co.id;
+      removal.operation = removal.REMOVE;
+      ops.push_back(removal);
+      ops.push_back(co);
+      ops.back().header.frame_id = frame;
+      ops.back().operation = co.ADD;
+      pendingSet.push_back(co);
+    }
+    // Otherwise you can just move it, if it really moved
+    else if (e->second.poseDigest != poseDigest(co) &&
+             (e->second.poseDigest == 0 ||
+              movedBeyondThresholds(e->second.object, co))) {
+      moveit_msgs::CollisionObject edits;
+      edits.header.frame_id = frame;
+      edits.id = co.id;
+      edits.operation = edits.MOVE;
+      edits.primitive_poses = co.primitive_poses;
+      ops.push_back(edits);
+      pendingSet.push_back(co);
+    }
+  }
+
+  // Anything not requested must have disappeared
+  for (std::unordered_map<std::string, Entry>::iterator e = objects.begin();
+       e != objects.end(); e++) {
+    if (e->first == ignoreID || seen.count(e->first) > 0) continue;
+    moveit_msgs::CollisionObject removal;
+    removal.header.frame_id = frame;
+    removal.id = e->first;
+    removal.operation = removal.REMOVE;
+    ops.push_back(removal);
+    pendingRemove.push_back(e->first);
+  }
+
+  return (ops.size() > numOps);
+}
+
+void SceneMirror::commit() {
+  for (int i = 0; i < pendingRemove.size(); i++) {
+    objects.erase(pendingRemove[i]);
+  }
+  for (int i = 0; i < pendingSet.size(); i++) {
+    add(pendingSet[i]);
+  }
+  pendingSet.clear();
+  pendingRemove.clear();
+}
+
+bool SceneMirror::lookup(const std::string& id, moveit_msgs::CollisionObject& co) {
+  std::unordered_map<std::string, Entry>::iterator e = objects.find(id);
+  if (e == objects.end()) return false;
+  co = e->second.object;
+  return true;
+}
+
+void SceneMirror::add(const moveit_msgs::CollisionObject& co) {
+  Entry e;
+  e.object = co;
+  e.geometryDigest = geometryDigest(co);
+  e.poseDigest = poseDigest(co);
+  objects[co.id] = e;
+}
+
+void SceneMirror::remove(const std::string& id) {
+  objects.erase(id);
+}
+
+void SceneMirror::invalidatePose(const std::string& id) {
+  std::unordered_map<std::string, Entry>::iterator e = objects.find(id);
+  if (e != objects.end()) e->second.poseDigest = 0;
+}
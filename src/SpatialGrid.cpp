@@ -0,0 +1,138 @@
+#include "SpatialGrid.h"
+
+#include <cmath>
+#include <algorithm>
+
+void SpatialGrid::clear() {
+  items.clear();
+  cells.clear();
+  slotOf.clear();
+  freeSlots.clear();
+}
+
+long long SpatialGrid::cellKey(int x, int y, int z) {
+  // 21 bits per axis is plenty for a room at any sane cell size
+  return ((((long long)x & 0x1FFFFF) << 42) |
+          (((long long)y & 0x1FFFFF) << 21) |
+          ((long long)z & 0x1FFFFF));
+}
+
+void SpatialGrid::addToCells(int slot) {
+  const Item& it = items[slot];
+  for (int x = cellIndex(it.center.x() - it.radius); x <= cellIndex(it.center.x() + it.radius); x++) {
+    for (int y = cellIndex(it.center.y() - it.radius); y <= cellIndex(it.center.y() + it.radius); y++) {
+      for (int z = cellIndex(it.center.z() - it.radius); z <= cellIndex(it.center.z() + it.radius); z++) {
+        cells[cellKey(x, y, z)].push_back(slot);
+      }
+    }
+  }
+}
+
+void SpatialGrid::removeFromCells(int slot) {
+  const Item& it = items[slot];
+  for (int x = cellIndex(it.center.x() - it.radius); x <= cellIndex(it.center.x() + it.radius); x++) {
+    for (int y = cellIndex(it.center.y() - it.radius); y <= cellIndex(it.center.y() + it.radius); y++) {
+      for (int z = cellIndex(it.center.z() - it.radius); z <= cellIndex(it.center.z() + it.radius); z++) {
+        std::unordered_map<long long, std::vector<int> >::iterator c =
+          cells.find(cellKey(x, y, z));
+        if (c == cells.end()) continue;
+        std::vector<int>& v = c->second;
+        std::vector<int>::iterator i = std::find(v.begin(), v.end(), slot);
+        if (i != v.end()) {
+          *i = v.back();
+          v.pop_back();
+        }
+        if (v.empty()) cells.erase(c);
+      }
+    }
+  }
+}
+
+void SpatialGrid::insert(int id, tf2::Vector3 center, double radius) {
+  std::unordered_map<int, int>::iterator s = slotOf.find(id);
+  int slot;
+  if (s != slotOf.end()) {
+    slot = s->second;
+    Item& it = items[slot];
+    // Most moves stay within the same cells
+    tf2::Vector3 r0(it.radius, it.radius, it.radius);
+    tf2::Vector3 r1(radius, radius, radius);
+    if (sameCells(it.center - r0, center - r1) && sameCells(it.center + r0, center + r1)) {
+      it.center = center;
+      it.radius = radius;
+      return;
+    }
+    removeFromCells(slot);
+  } else if (!freeSlots.empty()) {
+    slot = freeSlots.back();
+    freeSlots.pop_back();
+  } else {
+    slot = items.size();
+    items.push_back(Item());
+  }
+
+  Item& it = items[slot];
+  it.id = id;
+  it.center = center;
+  it.radius = radius;
+  it.stamp = 0;
+  slotOf[id] = slot;
+  addToCells(slot);
+}
+
+void SpatialGrid::remove(int id) {
+  std::unordered_map<int, int>::iterator s = slotOf.find(id);
+  if (s == slotOf.end()) return;
+  removeFromCells(s->second);
+  freeSlots.push_back(s->second);
+  slotOf.erase(s);
+}
+
+std::vector<int> SpatialGrid::candidates(tf2::Vector3 lo, tf2::Vector3 hi) {
+  std::vector<int> found;
+  queryStamp++;
+
+  for (int x = cellIndex(lo.x()); x <= cellIndex(hi.x()); x++) {
+    for (int y = cellIndex(lo.y()); y <= cellIndex(hi.y()); y++) {
+      for (int z = cellIndex(lo.z()); z <= cellIndex(hi.z()); z++) {
+        std::unordered_map<long long, std::vector<int> >::iterator c =
+          cells.find(cellKey(x, y, z));
+        if (c == cells.end()) continue;
+        for (int i = 0; i < c->second.size(); i++) {
+          Item& it = items[c->second[i]];
+          if (it.stamp == queryStamp) continue;
+          it.stamp = queryStamp;
+          found.push_back(c->second[i]);
+        }
+      }
+    }
+  }
+  return found;
+}
+
+std::vector<int> SpatialGrid::querySphere(tf2::Vector3 center, double radius) {
+  tf2::Vector3 r(radius, radius, radius);
+  std::vector<int> cands = candidates(center - r, center + r);
+
+  std::vector<int> ids;
+  for (int i = 0; i < cands.size(); i++) {
+    const Item& it = items[cands[i]];
+    if (it.center.distance(center) <= it.radius + radius) ids.push_back(it.id);
+  }
+  return ids;
+}
+
+std::vector<int> SpatialGrid::queryBox(tf2::Vector3 lo, tf2::Vector3 hi) {
+  std::vector<int> cands = candidates(lo, hi);
+
+  std::vector<int> ids;
+  for (int i = 0; i < cands.size(); i++) {
+    const Item& it = items[cands[i]];
+    // Distance from the sphere center to the closest point in the box
+    tf2::Vector3 closest(std::max(lo.x(), std::min(it.center.x(), hi.x())),
+                         std::max(lo.y(), std::min(it.center.y(), hi.y())),
+                         std::max(lo.z(), std::min(it.center.z(), hi.z())));
+    if (closest.distance(it.center) <= it.radius) ids.push_back(it.id);
+  }
+  return ids;
+}
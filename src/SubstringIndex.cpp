@@ -0,0 +1,119 @@
+#include "SubstringIndex.h"
+
+#include <algorithm>
+
+SubstringIndex::SubstringIndex(const std::vector<std::string>& n) {
+  for (int i = 0; i < n.size(); i++) add(n[i]);
+}
+
+SubstringIndex::Gram SubstringIndex::gramAt(const std::string& s, int i) {
+  return ((Gram)(unsigned char)s[i] << 16) |
+    ((Gram)(unsigned char)s[i + 1] << 8) |
+    (Gram)(unsigned char)s[i + 2];
+}
+
+void SubstringIndex::add(const std::string& name) {
+  if (has(name)) return;
+
+  int slot;
+  if (freeSlots.empty()) {
+    slot = names.size();
+    names.push_back(name);
+  } else {
+    slot = freeSlots.back();
+    freeSlots.pop_back();
+    names[slot] = name;
+  }
+  slots[name] = slot;
+  allSlots.push_back(slot);
+  lengths[name.size()]++;
+
+  // A name with a repeated trigram is still posted once for it
+  for (int i = 0; i + 3 <= (int)name.size(); i++) {
+    std::vector<int>& p = postings[gramAt(name, i)];
+    if (p.empty() || p.back() != slot) p.push_back(slot);
+  }
+}
+
+void SubstringIndex::remove(const std::string& name) {
+  std::unordered_map<std::string, int>::iterator s = slots.find(name);
+  if (s == slots.end()) return;
+  int slot = s->second;
+  slots.erase(s);
+
+  for (int i = 0; i + 3 <= (int)name.size(); i++) {
+    std::unordered_map<Gram, std::vector<int> >::iterator p = postings.find(gramAt(name, i));
+    if (p == postings.end()) continue;
+    p->second.erase(std::remove(p->second.begin(), p->second.end(), slot), p->second.end());
+    if (p->second.empty()) postings.erase(p);
+  }
+  allSlots.erase(std::remove(allSlots.begin(), allSlots.end(), slot), allSlots.end());
+  if (--lengths[name.size()] == 0) lengths.erase(name.size());
+  names[slot].clear();
+  freeSlots.push_back(slot);
+}
+
+void SubstringIndex::clear() {
+  names.clear();
+  freeSlots.clear();
+  allSlots.clear();
+  slots.clear();
+  postings.clear();
+  lengths.clear();
+}
+
+// A name containing query has every trigram of query, so the shortest
+// posting list of those trigrams holds all of them
+const std::vector<int>* SubstringIndex::candidates(const std::string& query) const {
+  if (query.size() < 3) return &allSlots;
+
+  const std::vector<int>* best = NULL;
+  for (int i = 0; i + 3 <= (int)query.size(); i++) {
+    std::unordered_map<Gram, std::vector<int> >::const_iterator p = postings.find(gramAt(query, i));
+    if (p == postings.end()) return NULL;
+    if (!best || p->second.size() < best->size()) best = &p->second;
+  }
+  return best;
+}
+
+// Tries every substring of text whose length some name has
+void SubstringIndex::containedIn(const std::string& text, std::vector<int>& out) const {
+  std::string sub;
+  for (std::map<int, int>::const_iterator l = lengths.begin(); l != lengths.end(); l++) {
+    if (l->first > text.size()) break;
+    for (int i = 0; i + l->first <= text.size(); i++) {
+      sub.assign(text, i, l->first);
+      std::unordered_map<std::string, int>::const_iterator s = slots.find(sub);
+      if (s != slots.end()) out.push_back(s->second);
+    }
+  }
+}
+
+std::string SubstringIndex::firstContaining(const std::string& query) const {
+  const std::vector<int>* c = candidates(query);
+  if (!c) return "";
+  const std::string* first = NULL;
+  for (int i = 0; i < c->size(); i++) {
+    const std::string& n = names[(*c)[i]];
+    if ((!first || n < *first) && n.find(query) != std::string::npos) first = &n;
+  }
+  return first ? *first : "";
+}
+
+std::string SubstringIndex::firstContainedIn(const std::string& text) const {
+  std::vector<int> found;
+  containedIn(text, found);
+  const std::string* first = NULL;
+  for (int i = 0; i < found.size(); i++) {
+    if (!first || names[found[i]] < *first) first = &names[found[i]];
+  }
+  return first ? *first : "";
+}
+
+std::string SubstringIndex::firstMatching(const std::string& s) const {
+  std::string a = firstContaining(s);
+  std::string b = firstContainedIn(s);
+  if (a == "") return b;
+  if (b == "") return a;
+  return std::min(a, b);
+}
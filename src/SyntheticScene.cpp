@@ -0,0 +1,126 @@
+#include "SyntheticScene.h"
+
+#include <sstream>
+#include <iomanip>
+#include <cmath>
+
+SyntheticScene::SyntheticScene(int models, unsigned int seed) : gen(seed) {
+  std::uniform_real_distribution<double> side(0.03, 0.12);
+  std::uniform_real_distribution<double> height(0.04, 0.25);
+  for (int i = 0; i < models; i++) {
+    shape_msgs::SolidPrimitive sp;
+    if (i % 2 == 0) {
+      sp.type = sp.BOX;
+      sp.dimensions.push_back(side(gen));
+      sp.dimensions.push_back(side(gen));
+      sp.dimensions.push_back(height(gen));
+    } else {
+      sp.type = sp.CYLINDER;
+      sp.dimensions.push_back(height(gen));
+      sp.dimensions.push_back(0.5*side(gen));
+    }
+    shapes.push_back(sp);
+  }
+}
+
+std::string SyntheticScene::modelName(int i) {
+  std::stringstream ss;
+  ss << "synthobj_" << std::setw(2) << std::setfill('0') << i;
+  return ss.str();
+}
+
+bool SyntheticScene::writeDatabase(std::string fileName, int numGrasps) {
+  std::ofstream ofs(fileName);
+  if (!ofs) {
+    ROS_WARN("SyntheticScene could not write database %s", fileName.c_str());
+    return false;
+  }
+
+  ofs << "{" << std::endl << "    \"objects\" : [" << std::endl;
+  for (int i = 0; i < shapes.size(); i++) {
+    const shape_msgs::SolidPrimitive& sp = shapes[i];
+    // Top grasp, same form as the real database entries
+    double top = 0.5*(sp.type == sp.BOX ? sp.dimensions[2] : sp.dimensions[0]);
+    ofs << "        {" << std::endl
+        << "            \"name\" : \"" << modelName(i) << "\"," << std::endl
+        << "            \"shapes\" : [" << std::endl
+        << "                {" << std::endl
+        << "                    \"shape\" : \"" << (sp.type == sp.BOX ? "box" : "cylinder") << "\"," << std::endl
+        << "                    \"dimensions\" : [";
+    for (int k = 0; k < sp.dimensions.size(); k++) {
+      ofs << (k > 0 ? ", " : "") << sp.dimensions[k];
+    }
+    ofs << "]" << std::endl
+        << "                }" << std::endl
+        << "            ]," << std::endl
+        << "            \"grasps\" : [" << std::endl;
+    for (int g = 0; g < numGrasps; g++) {
+      double yaw = 2*M_PI*g / numGrasps;
+      ofs << "                {" << std::endl
+          << "                    \"first\" : [0.0, 0.0, " << top + 0.06 << ", 0.0, 1.5708, " << yaw << "]," << std::endl
+          << "                    \"second\" : [0.0, 0.0, " << top << ", 0.0, 1.5708, " << yaw << "]" << std::endl
+          << "                }" << (g + 1 < numGrasps ? "," : "") << std::endl;
+    }
+    ofs << "            ]" << std::endl
+        << "        }" << (i + 1 < shapes.size() ? "," : "") << std::endl;
+  }
+  ofs << "    ]" << std::endl << "}" << std::endl;
+  ofs.close();
+  return true;
+}
+
+gazebo_msgs::ModelStates SyntheticScene::makeStates(int numObjects) {
+  gazebo_msgs::ModelStates ms;
+  geometry_msgs::Pose p;
+  p.orientation.w = 1.0;
+
+  ms.name.push_back("fetch");
+  ms.pose.push_back(p);
+  ms.name.push_back("ground_plane");
+  ms.pose.push_back(p);
+  p.position.x = 0.8;
+  ms.name.push_back("cafe_table");
+  ms.pose.push_back(p);
+
+  // A third of the objects on the table, the rest on the floor and on
+  // shelves up to 1.6m anywhere within 2.5m
+  std::uniform_real_distribution<double> onTable(-0.45, 0.45);
+  std::uniform_real_distribution<double> around(-2.5, 2.5);
+  std::uniform_real_distribution<double> level(0.0, 1.6);
+  std::uniform_real_distribution<double> yaw(-M_PI, M_PI);
+  std::uniform_int_distribution<int> model(0, shapes.size() - 1);
+  for (int i = 0; i < numObjects; i++) {
+    int m = model(gen);
+    const shape_msgs::SolidPrimitive& sp = shapes[m];
+    double h = (sp.type == sp.BOX ? sp.dimensions[2] : sp.dimensions[0]);
+
+    if (i % 3 == 0) {
+      p.position.x = 0.8 + onTable(gen);
+      p.position.y = onTable(gen);
+      p.position.z = 0.7 + 0.5*h;
+    } else {
+      p.position.x = around(gen);
+      p.position.y = around(gen);
+      p.position.z = level(gen) + 0.5*h;
+    }
+    tf2::Quaternion q;
+    q.setRPY(0, 0, yaw(gen));
+    p.orientation = tf2::toMsg(q);
+
+    std::stringstream ss;
+    ss << modelName(m) << "_" << i;
+    ms.name.push_back(ss.str());
+    ms.pose.push_back(p);
+  }
+  ms.twist.resize(ms.pose.size());
+  return ms;
+}
+
+void SyntheticScene::jitter(gazebo_msgs::ModelStates& ms, double amount) {
+  std::uniform_real_distribution<double> d(-amount, amount);
+  for (int i = 0; i < ms.name.size(); i++) {
+    if (ms.name[i].find("synthobj_") == std::string::npos) continue;
+    ms.pose[i].position.x += d(gen);
+    ms.pose[i].position.y += d(gen);
+  }
+}
@@ -1,100 +1,63 @@
 #include "WorldObjects.h"
 
-void WorldObjects::update(const gazebo_msgs::ModelStates::ConstPtr& msg) {
-  boost::lock_guard<boost::mutex> guard(objMutex);
-
-  objectPoses.clear();
-  objectRotations.clear();
-
-  for (int i = 0; i < msg->name.size(); i++) {
-    geometry_msgs::Pose p = msg->pose[i];
-
-    if (msg->name[i].find("fetch") != std::string::npos) {
-      tf2::Vector3 fetchVec;
-      tf2::fromMsg(p.position, fetchVec);
-      tf2::Quaternion fetchQuat;
-      tf2::fromMsg(p.orientation, fetchQuat);
-      worldXform = tf2::Transform(fetchQuat, fetchVec).inverse();
-      continue;
-    }
-    tf2::Vector3 v;
-    tf2::fromMsg(p.position, v);
-    objectPoses.insert(std::pair<std::string, tf2::Vector3>(msg->name[i],
-                                                            v));
-
-    tf2::Quaternion quat;
-    tf2::fromMsg(p.orientation, quat);
-    objectRotations.insert(std::pair<std::string, tf2::Quaternion>(msg->name[i],
-                                                                   quat));
+WorldObjects::WorldObjects() : tableH(0.675), updates(0), current(0) {
+  for (int i = 0; i < NUM_BUFFERS; i++) {
+    slots[i].buf = Buffer(new WorldSnapshot());
+    slots[i].pins = 0;
   }
 }
 
-bool WorldObjects::isInScene(std::string subName) {
-  if (nameInScene(subName) == "") return false;
-  else return true;
-}
-
-std::string WorldObjects::nameInScene(std::string subName) {
-  boost::lock_guard<boost::mutex> guard(objMutex);
-  for (std::map<std::string, tf2::Vector3>::iterator i = objectPoses.begin();
-       i != objectPoses.end(); i++) {
-    if (i->first.find(subName) != std::string::npos) {
-      return i->first;
+// Pin the slot, then check it is still current before copying its
+// pointer. The writer only refills or replaces slots that are not
+// current and not pinned, so a reader that pins one too late sees that
+// current has moved on and backs off without touching it.
+WorldSnapshot::ConstPtr WorldObjects::snapshot() {
+  while (true) {
+    int i = current.load();
+    slots[i].pins++;
+    if (current.load() == i) {
+      WorldSnapshot::ConstPtr snap = slots[i].buf;
+      slots[i].pins--;
+      return snap;
     }
+    slots[i].pins--;
   }
-  return "";
 }
 
-std::vector<std::string> WorldObjects::allObjectNames() {
-  std::vector<std::string> names;
-  for (std::map<std::string, tf2::Vector3>::iterator i = objectPoses.begin();
-       i != objectPoses.end(); i++) {
-    names.push_back(i->first);
+// A slot can be refilled once no reader holds its snapshot. If readers
+// still hold every spare one they keep theirs and the slot gets a new
+// snapshot, so this only waits out readers in the middle of a pin.
+int WorldObjects::spareSlot() {
+  int cur = current.load();
+  while (true) {
+    int unpinned = -1;
+    for (int i = 0; i < NUM_BUFFERS; i++) {
+      if (i == cur || slots[i].pins.load() != 0) continue;
+      if (slots[i].buf.use_count() == 1) {
+        // use_count() is a relaxed load; the fence orders it after the
+        // last reader's release of the snapshot, so that reader is done
+        // with it before the refill starts
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return i;
+      }
+      if (unpinned == -1) unpinned = i;
+    }
+    if (unpinned != -1) {
+      slots[unpinned].buf = Buffer(new WorldSnapshot());
+      return unpinned;
+    }
   }
-  return names;
-}
-
-tf2::Transform WorldObjects::getXformOf(std::string name) {
-  boost::lock_guard<boost::mutex> guard(objMutex);
-  return tf2::Transform(objectRotations[name], objectPoses[name]);
-}
-
-tf2::Vector3 WorldObjects::getPositionOf(std::string name) {
-  boost::lock_guard<boost::mutex> guard(objMutex);
-  return objectPoses[name];
-}
-
-float WorldObjects::getPosX(std::string name) {
-  boost::lock_guard<boost::mutex> guard(objMutex);
-  return objectPoses[name].x();
-}
-
-float WorldObjects::getPosY(std::string name) {
-  boost::lock_guard<boost::mutex> guard(objMutex);
-  return objectPoses[name].y();
-}
-
-float WorldObjects::getPosZ(std::string name) {
-  boost::lock_guard<boost::mutex> guard(objMutex);
-  return objectPoses[name].z();
-}
-
-tf2::Quaternion WorldObjects::getRotationOf(std::string name) {
-  boost::lock_guard<boost::mutex> guard(objMutex);
-  return objectRotations[name];
 }
 
-tf2::Vector3 WorldObjects::worldXformTimesPos(std::string name) {
-  boost::lock_guard<boost::mutex> guard(objMutex);
-  return worldXform*objectPoses[name];
-}
-
-tf2::Quaternion WorldObjects::worldXformTimesRot(std::string name) {
-  boost::lock_guard<boost::mutex> guard(objMutex);
-  return worldXform*objectRotations[name];
-}
+void WorldObjects::update(const gazebo_msgs::ModelStates::ConstPtr& msg, ros::Time stamp) {
+  if (stamp.isZero()) stamp = ros::Time::now();
 
-tf2::Transform WorldObjects::worldXformTimesTrans(std::string name) {
-  boost::lock_guard<boost::mutex> guard(objMutex);
-  return worldXform*tf2::Transform(objectRotations[name], objectPoses[name]);
+  boost::lock_guard<boost::mutex> guard(writeMutex);
+  const WorldSnapshot& previous = *slots[current.load()].buf;
+  int n = spareSlot();
+  WorldSnapshot& next = *slots[n].buf;
+  next.fill(*msg, ++updates, tableH, &previous);
+  next.received = stamp;
+  current.store(n);
+  history.record(next, stamp);
 }
@@ -0,0 +1,150 @@
+#include "WorldSnapshot.h"
+
+WorldSnapshot::WorldSnapshot(const gazebo_msgs::ModelStates& msg,
+                             unsigned long version,
+                             float tableHeight) {
+  fill(msg, version, tableHeight);
+}
+
+void WorldSnapshot::fill(const gazebo_msgs::ModelStates& msg,
+                         unsigned long version,
+                         float tableHeight,
+                         const WorldSnapshot* previous) {
+  ver = version;
+  tableH = tableHeight;
+  worldXform.setIdentity();
+
+  order.clear();
+  for (int i = 0; i < msg.name.size(); i++) {
+    if (msg.name[i].find("fetch") != std::string::npos) {
+      tf2::Vector3 fetchVec;
+      tf2::fromMsg(msg.pose[i].position, fetchVec);
+      tf2::Quaternion fetchQuat;
+      tf2::fromMsg(msg.pose[i].orientation, fetchQuat);
+      worldXform = tf2::Transform(fetchQuat, fetchVec).inverse();
+      continue;
+    }
+    order.push_back(i);
+  }
+  const std::vector<std::string>& msgNames = msg.name;
+  std::sort(order.begin(), order.end(),
+            [&msgNames](int a, int b) { return msgNames[a] < msgNames[b]; });
+
+  // resize rather than clear, so the names keep their string buffers
+  names.resize(order.size());
+  positions.resize(order.size());
+  rotations.resize(order.size());
+  for (int id = 0; id < order.size(); id++) {
+    const geometry_msgs::Pose& p = msg.pose[order[id]];
+    names[id].assign(msgNames[order[id]]);
+    tf2::fromMsg(p.position, positions[id]);
+    tf2::fromMsg(p.orientation, rotations[id]);
+  }
+  updateIndex(previous);
+}
+
+void WorldSnapshot::updateIndex(const WorldSnapshot* previous) {
+  if (!previous || !previous->nameIndex) {
+    nameIndex.reset(new SubstringIndex(names));
+    return;
+  }
+  if (previous->names == names) {
+    nameIndex = previous->nameIndex;
+    return;
+  }
+
+  // Both name lists are sorted, so walk them together
+  std::shared_ptr<SubstringIndex> next(new SubstringIndex(*previous->nameIndex));
+  const std::vector<std::string>& before = previous->names;
+  int i = 0;
+  int j = 0;
+  while (i < before.size() || j < names.size()) {
+    if (j == names.size() || (i < before.size() && before[i] < names[j])) {
+      next->remove(before[i++]);
+    } else if (i == before.size() || names[j] < before[i]) {
+      next->add(names[j++]);
+    } else {
+      i++;
+      j++;
+    }
+  }
+  nameIndex = next;
+}
+
+int WorldSnapshot::idOf(const std::string& name) const {
+  std::vector<std::string>::const_iterator i = std::lower_bound(names.begin(), names.end(), name);
+  if (i == names.end() || *i != name) return -1;
+  return i - names.begin();
+}
+
+bool WorldSnapshot::isInScene(std::string subName) const {
+  return (nameInScene(subName) != "");
+}
+
+// First name in order that contains subName
+std::string WorldSnapshot::nameInScene(std::string subName) const {
+  return nameIndex->firstContaining(subName);
+}
+
+tf2::Transform WorldSnapshot::getXformOf(std::string name) const {
+  int id = idOf(name);
+  if (id < 0) return tf2::Transform::getIdentity();
+  return tf2::Transform(rotations[id], positions[id]);
+}
+
+tf2::Vector3 WorldSnapshot::getPositionOf(std::string name) const {
+  int id = idOf(name);
+  if (id < 0) return tf2::Vector3(0, 0, 0);
+  return positions[id];
+}
+
+tf2::Quaternion WorldSnapshot::getRotationOf(std::string name) const {
+  int id = idOf(name);
+  if (id < 0) return tf2::Quaternion::getIdentity();
+  return rotations[id];
+}
+
+tf2::Vector3 WorldSnapshot::worldXformTimesPos(std::string name) const {
+  return worldXform*getPositionOf(name);
+}
+
+tf2::Quaternion WorldSnapshot::worldXformTimesRot(std::string name) const {
+  return worldXform*getRotationOf(name);
+}
+
+tf2::Transform WorldSnapshot::worldXformTimesTrans(std::string name) const {
+  return worldXform*getXformOf(name);
+}
+
+// The rotation is unrolled into scalars so the loop is a straight run of
+// multiply-adds over the position array
+void WorldSnapshot::worldPositions(std::vector<tf2::Vector3>& out) const {
+  const tf2::Matrix3x3& b = worldXform.getBasis();
+  const tf2::Vector3& t = worldXform.getOrigin();
+  const double b00 = b[0].x(), b01 = b[0].y(), b02 = b[0].z();
+  const double b10 = b[1].x(), b11 = b[1].y(), b12 = b[1].z();
+  const double b20 = b[2].x(), b21 = b[2].y(), b22 = b[2].z();
+  const double tx = t.x(), ty = t.y(), tz = t.z();
+
+  int n = positions.size();
+  out.resize(n);
+  for (int i = 0; i < n; i++) {
+    const double x = positions[i].x(), y = positions[i].y(), z = positions[i].z();
+    out[i].setValue(b00*x + b01*y + b02*z + tx,
+                    b10*x + b11*y + b12*z + ty,
+                    b20*x + b21*y + b22*z + tz);
+  }
+}
+
+void WorldSnapshot::worldXforms(std::vector<tf2::Transform>& out) const {
+  std::vector<tf2::Vector3> origins;
+  worldPositions(origins);
+  tf2::Quaternion worldRot = worldXform.getRotation();
+
+  int n = positions.size();
+  out.resize(n);
+  for (int i = 0; i < n; i++) {
+    out[i].setOrigin(origins[i]);
+    out[i].setRotation(worldRot*rotations[i]);
+  }
+}